@@ -0,0 +1,49 @@
+#ifndef __CLASSIFIER_H__
+#define __CLASSIFIER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+
+#include "endpoint.h"
+#include "service.h"
+
+#define CLASSIFIER_TBL8		0x80000000	//Entry of tbl24 is index of tbl8 block
+#define CLASSIFIER_PENDING	0x40000000	//tbl8 block is counted but not allocated yet
+#define CLASSIFIER_GRACE	1000000		//us. Old table is freed after lookups on it are done
+
+#define CLASSIFIER	"net.lb.classifier"
+
+//Services sharing an address prefix. Rules are ordered narrow port range first
+typedef struct _ClassifierGroup {
+	uint32_t	addr;
+	uint8_t		prefix;
+	uint32_t	parent;		//Group of covering prefix. 0 is none
+	uint32_t	rule_start;
+	uint32_t	rule_count;
+} ClassifierGroup;
+
+typedef struct _ClassifierRule {
+	uint16_t	port_start;
+	uint16_t	port_end;
+	uint8_t		protocol;
+	uint16_t	vlan;
+	Service*	service;
+} ClassifierRule;
+
+//DIR-24-8 table. Leaf is group index + 1, 0 is no match
+typedef struct _Classifier {
+	uint32_t*	tbl24;
+	uint32_t*	tbl8;
+	uint32_t	tbl8_count;
+	ClassifierGroup*	groups;
+	uint32_t	group_count;
+	ClassifierRule*	rules;
+	uint32_t	rule_count;
+} Classifier;
+
+bool classifier_build(NetworkInterface* ni);
+void classifier_clear(NetworkInterface* ni);
+Service* classifier_get(Endpoint* endpoint);
+
+#endif /*__CLASSIFIER_H__*/
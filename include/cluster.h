@@ -0,0 +1,50 @@
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#include "endpoint.h"
+#include "tunnel.h"
+
+#define CLUSTER_MAX_MEMBERS	64
+#define CLUSTER_SIZE		4093		//Prime. Much larger than instances
+#define CLUSTER_TRANSITION	300000000	//us. Flows are chained through previous owner after membership change
+#define CLUSTER_GRACE		1000000		//us. Old cluster is freed after lookups on it are done
+#define CLUSTER_TTL		64		//Outer TTL of first redirect. Instances share a segment.
+#define CLUSTER_REDIRECTS	2		//Previous owner, then current owner
+
+//Owner of flows over a snapshot of instances. Every instance builds the same table.
+typedef struct _ClusterTable {
+	uint32_t	count;
+	uint32_t	members[CLUSTER_MAX_MEMBERS];	//Ascending order
+	Tunnel*		tunnels[CLUSTER_MAX_MEMBERS];	//NULL is this instance
+	uint16_t	lookup[CLUSTER_SIZE];
+} ClusterTable;
+
+typedef struct _Cluster {
+	NetworkInterface*	ni;	//NIC of services. Instances reach each other on it.
+	uint32_t	addr;		//This instance
+	ClusterTable*	current;
+	ClusterTable*	previous;	//Only while membership is changing
+	uint64_t	transition_end;
+
+	uint64_t	redirect_count;
+	uint64_t	receive_count;
+} Cluster;
+
+Cluster* cluster_create(NetworkInterface* ni, uint32_t addr, uint32_t* members, uint32_t count, Cluster* old);
+void cluster_destroy(Cluster* cluster);
+uint32_t cluster_next(Cluster* cluster, uint64_t hash, bool is_new, uint8_t redirects);
+
+bool cluster_start(NetworkInterface* ni, uint32_t addr);
+void cluster_stop();
+bool cluster_add(uint32_t addr);
+bool cluster_remove(uint32_t addr);
+uint8_t cluster_decap(Packet* packet);
+bool cluster_redirect(Endpoint* service_endpoint, Endpoint* client_endpoint, uint8_t redirects, Packet* packet);
+void cluster_dump();
+
+#endif /*__CLUSTER_H__*/
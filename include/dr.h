@@ -1,10 +1,13 @@
 #ifndef __DR_H__
 #define __DR_H__
 
+#include <net/packet.h>
+
 #include "server.h"
 #include "endpoint.h"
 #include "session.h"
 
 Session* dr_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
+bool dr_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet);
 
 #endif /*__DR_H__*/
@@ -0,0 +1,25 @@
+#ifndef __DROP_H__
+#define __DROP_H__
+
+#include <stdint.h>
+#include <net/packet.h>
+
+#define DROP_MAX_THREADS	16
+
+#define DROP_PROTOCOL		0	//Not ARP, ICMP, TCP or UDP of loadbalancer
+#define DROP_NO_SERVICE		1	//No service, session or server matched
+#define DROP_REJECT		2	//Service refused new session
+#define DROP_RETRANSMIT		3	//Client retransmits while server is connecting
+#define DROP_INVALID		4	//Bad handshake or stale one-packet reply
+#define DROP_FRAGMENT		5	//Fragment whose first fragment never came
+#define DROP_NEIGHBOR		6	//Next hop is not resolved
+#define DROP_HEADROOM		7	//No room to push header
+#define DROP_TX_FULL		8	//Output ring and deferred queue are full
+#define DROP_SHAPED		9	//Over packet or bandwidth limit of service or server
+#define DROP_REASONS		10
+
+void drop_packet(Packet* packet, uint8_t reason);
+void drop_reset();
+void drop_dump();
+
+#endif /*__DROP_H__*/
@@ -8,8 +8,14 @@ typedef struct _Endpoint {
 	uint32_t		addr;
 	uint8_t			protocol;
 	uint16_t		port;
+	uint16_t		vlan;		//802.1Q VLAN id. 0 is untagged
 } Endpoint;
 
+//Protocol keeps 4 bits(TCP and UDP differ) to leave room for VLAN
+static inline uint64_t endpoint_key(Endpoint* endpoint) {
+	return (uint64_t)endpoint->vlan << 52 | (uint64_t)(endpoint->protocol & 0xf) << 48 | (uint64_t)endpoint->addr << 16 | (uint64_t)endpoint->port;
+}
+
 Endpoint* endpoint_alloc(NetworkInterface* ni, uint32_t addr, uint8_t protocol, uint16_t port);
 bool endpoint_free(NetworkInterface* ni, Endpoint* endpoint);
 #endif /* __INTERFACE_H__ */
@@ -0,0 +1,69 @@
+#ifndef __FRAG_H__
+#define __FRAG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+#define FRAG_SIZE	1024	//Datagrams being forwarded. Power of 2
+#define FRAG_PROBE	4	//Max slots probed per lookup
+#define FRAG_HOLD	64	//Fragments held before their first fragment
+#define FRAG_TIMEOUT	1000	//ms
+
+#define FRAG_MORE	0x2000
+#define FRAG_OFFSET	0x1fff
+
+#define FRAGS	"net.lb.frags"
+
+//Headers of first fragment before translation. Fields are network byte order.
+typedef struct _FragKey {
+	uint32_t	source;
+	uint32_t	destination;
+	uint16_t	id;
+	uint16_t	flags_offset;
+	uint8_t		protocol;
+	uint8_t		header[TCP_LEN];
+} FragKey;
+
+//Translation of first fragment. Later fragments copy it without session.
+typedef struct _FragEntry {
+	uint32_t	source;
+	uint32_t	destination;
+	uint16_t	id;
+	uint8_t		protocol;
+	uint32_t	time;		//ms
+	NetworkInterface*	ni;	//Output. NULL is empty
+	uint64_t	smac;
+	uint64_t	dmac;
+	uint32_t	new_source;
+	uint32_t	new_destination;
+	struct _Tunnel*	tunnel;		//Encapsulated to server. NULL is translated
+	uint16_t	vlan;		//Egress VLAN
+} FragEntry;
+
+typedef struct _FragHold {
+	uint32_t	time;		//ms
+	Packet*		packet;		//NULL is empty
+} FragHold;
+
+typedef struct _Frag {
+	FragEntry	entries[FRAG_SIZE];
+	FragHold	holds[FRAG_HOLD];
+} Frag;
+
+static inline bool frag_is_first(IP* ip) {
+	return (endian16(ip->flags_offset) & (FRAG_MORE | FRAG_OFFSET)) == FRAG_MORE;
+}
+
+static inline bool frag_is_later(IP* ip) {
+	return !!(endian16(ip->flags_offset) & FRAG_OFFSET);
+}
+
+void frag_key(FragKey* key, IP* ip);
+void frag_update(FragKey* key, Packet* packet, NetworkInterface* ni, struct _Tunnel* tunnel, uint16_t vlan);
+bool frag_process(Packet* packet);
+
+#endif /*__FRAG_H__*/
@@ -0,0 +1,45 @@
+#ifndef __HEALTH_H__
+#define __HEALTH_H__
+
+#include <stdbool.h>
+#include <net/ni.h>
+
+#include "server.h"
+#include "endpoint.h"
+
+#define HEALTH_TCP	1	//TCP connect
+#define HEALTH_UDP	2	//UDP echo
+#define HEALTH_HTTP	3	//HTTP GET, 2xx or 3xx is success
+
+#define HEALTH_STATE_IDLE	0
+#define HEALTH_STATE_CONNECT	1	//SYN or datagram sent
+#define HEALTH_STATE_REQUEST	2	//HTTP request sent
+
+#define HEALTH_PATH_SIZE	64
+
+#define HEALTHS	"net.lb.healths"
+
+typedef struct _Health {
+	Server*		server;
+	uint8_t		type;
+	uint64_t	interval;	//us. Also timeout of a probe
+	uint64_t	jitter;		//us. Random delay added to each interval
+	uint8_t		rise;		//Consecutive successes to activate
+	uint8_t		fall;		//Consecutive failures to deactivate
+	uint8_t		success_count;
+	uint8_t		fail_count;
+	uint64_t	event_id;
+
+	//Probe in flight
+	uint8_t		state;
+	Endpoint	source;
+	uint32_t	sequence;
+	char		path[HEALTH_PATH_SIZE];
+} Health;
+
+bool health_start(Server* server, uint8_t type, uint64_t interval, uint8_t rise, uint8_t fall, uint64_t jitter);
+bool health_set_path(Server* server, char* path);
+void health_stop(Server* server);
+bool health_process(Endpoint* destination_endpoint, Packet* packet);
+
+#endif /*__HEALTH_H__*/
@@ -0,0 +1,16 @@
+#ifndef __ICMPERROR_H__
+#define __ICMPERROR_H__
+
+#include <stdbool.h>
+#include <net/packet.h>
+
+#ifndef ICMP_TYPE_SOURCE_QUENCH
+#define ICMP_TYPE_SOURCE_QUENCH		4
+#endif
+#ifndef ICMP_TYPE_PARAMETER_PROBLEM
+#define ICMP_TYPE_PARAMETER_PROBLEM	12
+#endif
+
+bool icmperror_process(Packet* packet, uint16_t vlan);
+
+#endif /*__ICMPERROR_H__*/
@@ -0,0 +1,56 @@
+#ifndef __IPV6_H__
+#define __IPV6_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#include "server.h"
+#include "service.h"
+
+#define IPV6_LEN		40
+#define IPV6_FLOW_SIZE		16384	//Flows per service. Power of 2
+#define IPV6_FLOW_PROBE		8	//Max slots probed per lookup
+#define IP_PROTOCOL_IPV6	41	//IPv6 in IPv4
+
+#define SERVICES6	"net.lb.services6"
+
+typedef struct _IPv6 {
+	uint32_t	version_class_flow;
+	uint16_t	length;		//Payload
+	uint8_t		next_header;
+	uint8_t		hop_limit;
+	uint8_t		source[16];
+	uint8_t		destination[16];
+	uint8_t		body[0];
+} __attribute__ ((packed)) IPv6;
+
+//Flow is found by 64 bit hash of 5-tuple and verified by full key
+typedef struct _Flow6 {
+	uint64_t	hash;
+	uint8_t		source[16];
+	uint8_t		destination[16];
+	uint16_t	source_port;
+	uint16_t	destination_port;
+	uint8_t		protocol;
+	uint32_t	time;		//Last used(ms)
+	Server*		server;		//NULL is empty
+} Flow6;
+
+//IPv6 address of service. It is scheduled over servers of the service in DR or tunnel mode.
+typedef struct _Service6 {
+	uint8_t		addr[16];
+	uint64_t	key;
+	uint32_t	count;
+	Flow6		flows[IPV6_FLOW_SIZE];
+} Service6;
+
+bool ipv6_parse(char* str, uint8_t* addr);
+
+bool ipv6_create(Service* service, uint8_t* addr);
+void ipv6_destroy(Service* service);
+void ipv6_remove_server(Service* service, Server* server);
+bool ipv6_process(Packet* packet);
+
+#endif /*__IPV6_H__*/
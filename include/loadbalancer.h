@@ -6,6 +6,26 @@
 #include <net/ni.h>
 #include <stdbool.h>
 
+static inline uint64_t cpu_tsc() {
+	uint64_t time;
+	uint32_t* p = (uint32_t*)&time;
+	asm volatile("rdtsc" : "=a"(p[0]), "=d"(p[1]));
+
+	return time;
+}
+
+//Incremental checksum update(RFC 1624). One's complement sum is independent of byte order.
+static inline uint32_t lb_checksum_adjust(uint32_t sum, uint16_t old, uint16_t new) {
+	return sum + (uint16_t)~old + new;
+}
+
+static inline uint16_t lb_checksum_fold(uint32_t sum) {
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
 int lb_ginit();
 int lb_init();
 void lb_loop();
@@ -0,0 +1,53 @@
+#ifndef __MAGLEV_H__
+#define __MAGLEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <util/map.h>
+
+#include "server.h"
+
+#define MAGLEV_SIZE		16381	//Prime. Much larger than servers
+#define MAGLEV_TRANSITION	30000000	//us. Flows of previous table are kept after membership change
+#define MAGLEV_FLOWS		65536		//Flows remembered while membership is changing. Power of 2
+#define MAGLEV_FLOW_PROBE	8		//Max slots probed per lookup
+#define MAGLEV_FLOW_TIMEOUT	10000		//ms. Idle flow slot is reused after
+
+//Consistent hash lookup table over a snapshot of servers
+typedef struct _MaglevTable {
+	uint32_t	count;
+	Server**	servers;	//NULL entry is removed server
+	uint16_t	lookup[MAGLEV_SIZE];
+} MaglevTable;
+
+//First choice of a flow while membership is changing
+typedef struct _MaglevFlow {
+	uint64_t	hash;
+	uint32_t	time;		//Last used(ms)
+	Server*		server;		//NULL is empty
+} MaglevFlow;
+
+typedef struct _Maglev {
+	uint32_t	generation;	//Server generation the table is built for
+	MaglevTable*	current;
+	MaglevTable*	previous;	//Only while membership is changing
+	uint64_t	transition_end;
+	MaglevFlow	flows[MAGLEV_FLOWS];	//Fixed size open addressing table with lazy aging
+} Maglev;
+
+void maglev_populate(uint64_t* keys, uint8_t* weights, uint32_t count, uint32_t size, uint16_t* lookup);
+
+Maglev* maglev_create();
+void maglev_destroy(Maglev* maglev);
+Server* maglev_get(Maglev* maglev, List* servers, uint64_t hash, bool is_new);
+
+static inline uint64_t maglev_hash(Endpoint* source_endpoint, Endpoint* destination_endpoint) {
+	uint64_t hash = (uint64_t)source_endpoint->addr << 32 | destination_endpoint->addr;
+	hash *= 0x9e3779b97f4a7c15;
+	hash ^= (uint64_t)source_endpoint->protocol << 32 | (uint64_t)source_endpoint->port << 16 | destination_endpoint->port;
+	hash *= 0x9e3779b97f4a7c15;
+
+	return hash ^ (hash >> 32);
+}
+
+#endif /*__MAGLEV_H__*/
@@ -0,0 +1,39 @@
+#ifndef __NEIGHBOR_H__
+#define __NEIGHBOR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#define NEIGHBOR_HOLD		16	//Packets held per unresolved next hop
+#define NEIGHBOR_RETRY		200	//ms. ARP request is resent while unresolved
+#define NEIGHBOR_RETRIES	5	//Held packets are dropped after this many requests
+#define NEIGHBOR_REFRESH	5000	//ms. Shorter than ARP timeout of stack so that entries of servers never expire
+#define NEIGHBOR_TIMEOUT	30000	//ms. Tagged neighbor is forgotten if it does not answer for this long
+
+#define NEIGHBORS	"net.lb.neighbors"
+
+/*
+ * Next hop waiting for ARP reply. Keyed by (vlan, addr).
+ * Stack ARP table has no VLAN, so tagged neighbors are resolved and kept here.
+ */
+typedef struct _Neighbor {
+	uint32_t	addr;
+	uint16_t	vlan;
+	uint32_t	source;		//Sender address of ARP request
+	uint32_t	time;		//ms. Last ARP request
+	uint64_t	mac;		//Tagged neighbor only. 0 is unresolved
+	uint32_t	learned;	//ms. Last ARP from tagged neighbor
+	uint8_t		retries;
+	uint8_t		count;
+	Packet*		packets[NEIGHBOR_HOLD];
+	uint16_t	vlans[NEIGHBOR_HOLD];
+} Neighbor;
+
+bool neighbor_init();
+bool neighbor_process(Packet* packet, uint16_t vlan);
+void neighbor_resolve(NetworkInterface* ni, uint32_t destination, uint16_t vlan, Packet* packet);
+bool neighbor_output(NetworkInterface* ni, uint32_t destination, uint32_t source, uint16_t vlan, Packet* packet);
+
+#endif /*__NEIGHBOR_H__*/
@@ -0,0 +1,46 @@
+#ifndef __OPS_H__
+#define __OPS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#include "endpoint.h"
+#include "service.h"
+
+#define OPS_BLOCK	4096	//Ports are reserved and looked up in aligned blocks
+#define OPS_DEFAULT_SIZE	4096	//Ports of ring. Power of 2
+#define OPS_MAX_SIZE	32768	//Upper half of port space
+#define OPS_TIMEOUT	2000	//ms. Reply is accepted while the slot is not older. Younger slot is never reused.
+
+#define OPSES	"net.lb.ops"
+
+//One-packet scheduling. Slot of ring is the NAT port of a datagram.
+typedef struct _OpsEntry {
+	uint32_t	client_addr;
+	uint16_t	client_port;
+	uint16_t	server_port;
+	uint32_t	server_addr;	//0 is empty
+	uint32_t	service_addr;	//Address and port client reached
+	uint16_t	service_port;
+	uint16_t	payload_id;	//First 2 bytes of request. Echoed by reply of DNS like protocol
+	uint32_t	time;		//ms
+} OpsEntry;
+
+typedef struct _Ops {
+	Service*	service;
+	NetworkInterface*	ni;
+	uint32_t	addr;		//Private address
+	uint16_t	base;		//First port of ring. Aligned to size
+	uint32_t	size;		//Power of 2. Enough for rate * OPS_TIMEOUT
+	uint32_t	next;
+	OpsEntry	entries[0];
+} Ops;
+
+bool ops_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet);
+bool ops_process_reply(Endpoint* private_endpoint, Endpoint* server_endpoint, Packet* packet);
+void ops_remove(Service* service, NetworkInterface* ni);
+void ops_destroy(Service* service);
+
+#endif /*__OPS_H__*/
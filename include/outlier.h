@@ -0,0 +1,39 @@
+#ifndef __OUTLIER_H__
+#define __OUTLIER_H__
+
+#include <stdbool.h>
+
+#include "server.h"
+
+#define OUTLIER_BUCKETS			8
+#define OUTLIER_MAX_BACKOFF		5	//Ejection time is capped at base << 5
+#define OUTLIER_DEFAULT_DEADLINE	200000	//us. Handshake or UDP reply later than this is an error
+
+//Passive outlier detection from datapath signals
+typedef struct _OutlierBucket {
+	uint32_t	epoch;
+	uint32_t	success;
+	uint32_t	error;
+} OutlierBucket;
+
+typedef struct _Outlier {
+	Server*		server;
+	uint8_t		error_percent;	//Error rate to eject
+	uint32_t	min_requests;	//Minimum samples in window to evaluate
+	uint32_t	bucket_time;	//ms. Window is OUTLIER_BUCKETS * bucket_time
+	uint64_t	ejection_time;	//us. Base ejection time, doubled on each ejection
+	uint64_t	deadline;	//us. Of SYN-ACK or first UDP reply
+	uint8_t		ejection_count;
+	uint64_t	return_time;	//Last time server returned from ejection(us)
+	uint64_t	event_id;
+
+	OutlierBucket	buckets[OUTLIER_BUCKETS];
+} Outlier;
+
+bool outlier_start(Server* server, uint8_t error_percent, uint32_t min_requests, uint64_t window, uint64_t ejection_time, uint64_t deadline);
+void outlier_stop(Server* server);
+
+void outlier_success(Server* server);
+void outlier_error(Server* server);
+
+#endif /*__OUTLIER_H__*/
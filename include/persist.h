@@ -0,0 +1,35 @@
+#ifndef __PERSIST_H__
+#define __PERSIST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "server.h"
+
+#define PERSIST_DEFAULT_SIZE	65536
+#define PERSIST_MAX_SIZE	1048576
+#define PERSIST_PROBE		8	//Max slots probed per lookup
+
+//Client affinity. Fixed size open addressing table with lazy aging.
+typedef struct _PersistEntry {
+	uint32_t	addr;
+	uint32_t	time;		//Last used(ms)
+	Server*		server;		//NULL is empty
+} PersistEntry;
+
+typedef struct _Persist {
+	uint32_t	mask;		//Client subnet mask
+	uint32_t	timeout;	//ms
+	uint32_t	size;		//Power of 2
+	uint32_t	count;
+	PersistEntry	entries[0];
+} Persist;
+
+Persist* persist_create(uint64_t timeout, uint8_t prefix, uint32_t size);
+void persist_destroy(Persist* persist);
+
+Server* persist_get(Persist* persist, uint32_t addr);
+bool persist_put(Persist* persist, uint32_t addr, Server* server);
+void persist_remove_server(Persist* persist, Server* server);
+
+#endif /*__PERSIST_H__*/
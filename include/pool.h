@@ -0,0 +1,37 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <util/list.h>
+
+#include "server.h"
+#include "service.h"
+
+#define POOL_NAME_SIZE	32
+
+typedef struct _Pool {
+	char		name[POOL_NAME_SIZE];
+
+	List*		active_servers;
+	List*		deactive_servers;
+	List*		services;
+
+	//Snapshot of active_servers. Rebuilt on membership change for O(1) scheduling
+	Server**	servers;
+	uint32_t	server_count;
+} Pool;
+
+Pool* pool_alloc(char* name);
+bool pool_free(Pool* pool);
+Pool* pool_get(char* name);
+
+bool pool_add_server(Pool* pool, Server* server);
+bool pool_remove_server(Pool* pool, Server* server);
+bool pool_active_server(Pool* pool, Server* server);
+bool pool_deactive_server(Pool* pool, Server* server);
+
+bool pool_add_service(Pool* pool, Service* service);
+bool pool_remove_service(Pool* pool, Service* service);
+
+void pool_dump();
+
+#endif /*__POOL_H__*/
@@ -0,0 +1,28 @@
+#ifndef __QUIC_H__
+#define __QUIC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+
+#include "server.h"
+#include "service.h"
+
+#define QUIC_CID_LENGTH		8	//Length of connection ID issued by servers
+#define QUIC_SERVER_MAX		256
+#define QUIC_CID_UNROUTABLE	0xc0	//Config rotation bits 0b11 of first octet. Client chosen
+
+/*
+ * Server encodes its id in connection ID it issues.
+ * Octet 0: config rotation(2 bits) | length(6 bits), Octet 1: server id(1~255), Others: opaque
+ */
+typedef struct _Quic {
+	uint32_t	generation;	//Server generation the table is built for
+	Server*		servers[QUIC_SERVER_MAX];
+} Quic;
+
+Quic* quic_create();
+void quic_destroy(Quic* quic);
+Server* quic_get_server(Service* service, Packet* packet);
+
+#endif /*__QUIC_H__*/
@@ -0,0 +1,47 @@
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RATELIMIT_SKETCH_DEPTH	4
+#define RATELIMIT_SKETCH_WIDTH	16384	//Power of 2
+#define RATELIMIT_DEFAULT_SIZE	4096	//Clients tracked at once. Power of 2
+#define RATELIMIT_MAX_SIZE	1048576
+#define RATELIMIT_MAX_BURST	(UINT32_MAX / 1000)	//Tokens of bucket fit in 32 bits
+#define RATELIMIT_PROBE		8	//Max slots probed per lookup
+#define RATELIMIT_DECAY		1000000	//us. New connection sketch is halved every period
+
+//Client of heavy connection rate or of live sessions. Tokens are in 1/1000 connection.
+typedef struct _RateBucket {
+	uint32_t	addr;
+	uint32_t	time;		//Last refill(ms). 0 is empty
+	uint32_t	tokens;
+	uint32_t	sessions;	//Exact concurrent connections. Slot is kept while not 0
+} RateBucket;
+
+//Per client new connection rate & concurrent connection limit.
+//Count-min sketch filters light clients of rate. Fixed size open addressing table with lazy aging holds buckets.
+typedef struct _RateLimit {
+	uint32_t	rate;		//New connections per second. 0 is unlimited
+	uint32_t	burst;
+	uint32_t	threshold;	//Sketch estimate reaching bucket table. Steady rate r is estimated about 2r.
+	uint32_t	max_sessions;	//Concurrent connections. 0 is unlimited
+
+	uint64_t	reject_rate;
+	uint64_t	reject_sessions;
+
+	uint64_t	event_id;
+	uint16_t	news[RATELIMIT_SKETCH_DEPTH][RATELIMIT_SKETCH_WIDTH];
+	uint32_t	size;		//Power of 2
+	RateBucket	buckets[0];
+} RateLimit;
+
+RateLimit* ratelimit_create(uint32_t rate, uint32_t burst, uint32_t max_sessions, uint32_t size);
+void ratelimit_destroy(RateLimit* ratelimit);
+
+bool ratelimit_admit(RateLimit* ratelimit, uint32_t addr);
+bool ratelimit_open(RateLimit* ratelimit, uint32_t addr);
+void ratelimit_close(RateLimit* ratelimit, uint32_t addr);
+
+#endif /*__RATELIMIT_H__*/
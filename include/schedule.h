@@ -9,15 +9,19 @@
 #define SCHEDULE_LEAST			3
 #define SCHEDULE_SOURCE_IP_HASH		4
 #define SCHEDULE_WEIGHTED_ROUND_ROBIN	5
+#define SCHEDULE_MIN_REQUEST_TIME	6
 
 typedef struct _RoundRobin {
 	uint32_t robin;
 } RoundRobin;
 
+bool schedule_set_priority(Service* service);
+
 Server* schedule_round_robin(Service* service, Endpoint* client_endpoint);
 Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoint);
 Server* schedule_random(Service* service, Endpoint* client_endpoint);
 Server* schedule_least(Service* service, Endpoint* client_endpoint);
 Server* schedule_source_ip_hash(Service* service, Endpoint* client_endpoint);
+Server* schedule_min_request_time(Service* service, Endpoint* client_endpoint);
 
 #endif /*__SCHEDULE_H__*/
@@ -9,11 +9,17 @@
 #include "endpoint.h"
 
 #define SERVER_STATE_ACTIVE	1
-#define SERVER_STATE_DEACTIVE	2
+#define SERVER_STATE_DEACTIVE	2	//Removing
+#define SERVER_STATE_DOWN	3	//Failed health check
+#define SERVER_STATE_EJECTED	4	//Outlier ejected for a while
 
 #define MODE_NAT	1
 #define MODE_DNAT	2
 #define MODE_DR		3
+#define MODE_TUNNEL	4
+
+#define SERVER_DEFAULT_WEIGHT	1
+#define SERVER_WEIGHT_SCALE	256	//Effective weight is fixed point of weight * SERVER_WEIGHT_SCALE
 
 #define SERVERS	"net.lb.servers"
 
@@ -24,15 +30,41 @@ typedef struct _Server {
 	uint64_t	event_id;
 	uint8_t		mode;
 	uint8_t		weight;
+	uint64_t	slow_start;	//Ramp window of weight(us). 0 is disable
+	uint64_t	start_time;	//Begin of ramp. 0 is full weight
+	uint8_t		priority;	//Tier. 0 is primary, higher is backup
+	uint32_t	max_sessions;	//0 is unlimited
+	uint8_t		quic_id;	//Server id in QUIC connection ID. 0 is none
 	Map*		sessions;
+	struct _Pool*	pool;		//NULL is bound to services by NIC
+	struct _Health*	health;		//Active health check. NULL is disable
+	struct _Outlier*	outlier;	//Passive outlier detection. NULL is disable
+	struct _Tunnel*	tunnel;		//Outer header template. Kept until server is freed
+	struct _Shaper*	shaper;		//Packet and bandwidth limit. NULL is disable
+
+	uint64_t	rtt;		//EWMA of handshake RTT(us)
+	uint64_t	response_time;	//EWMA of time to first response byte(us)
 	
 	Session*	(*create)(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
 	void*		priv;
 } Server;
 
-Server* server_alloc(Endpoint* server_endpoint);
+Server* server_alloc(Endpoint* server_endpoint, struct _Pool* pool);
 bool server_free(Server* server);
 bool server_set_mode(Server* server, uint8_t mode);
+bool server_set_tunnel(Server* server, uint8_t type, uint16_t port);
+bool server_set_state(Server* server, uint8_t state);
+bool server_set_weight(Server* server, uint8_t weight);
+void server_set_priority(Server* server, uint8_t priority);
+void server_set_max_sessions(Server* server, uint32_t max_sessions);
+void server_set_quic_id(Server* server, uint8_t quic_id);
+bool server_set_shaper(Server* server, uint64_t pps, uint64_t bps, uint8_t action);
+bool server_is_full(Server* server);
+void server_set_slow_start(Server* server, uint64_t slow_start);
+void server_start(Server* server);
+uint32_t server_get_weight(Server* server);
+void server_changed();
+uint32_t server_get_generation();
 
 Server* server_get(Endpoint* server_endpoint);
 
@@ -42,6 +74,9 @@ bool server_remove(Server* server, uint64_t wait);
 bool server_remove_force(Server* server);
 void server_is_remove_grace(Server* server);
 
+void server_update_rtt(Server* server, uint64_t sample);
+void server_update_response_time(Server* server, uint64_t sample);
+
 void server_dump();
 
 #endif/* __SERVER_H__*/
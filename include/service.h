@@ -2,6 +2,7 @@
 #define __SERVICE_H__
 
 #include <net/ni.h>
+#include <net/packet.h>
 #include <util/list.h>
 #include <util/map.h>
 
@@ -13,30 +14,68 @@
 #define SERVICE_STATE_DEACTIVE	2
 
 #define SERVICE_DEFAULT_TIMEOUT	30000000
+#define SERVICE_DEFAULT_MAX_EJECTION	50	//percent
 
 #define SERVICES	"net.lb.services"
 
 typedef struct _Service {
-	Endpoint	endpoint;
+	Endpoint	endpoint;	//First address and port of range
+	uint8_t		prefix;		//Address prefix length. 32 is single address
+	uint16_t	port_end;	//Last port of range
 
 	uint64_t	timeout;
 	uint8_t		state;
 	uint64_t	event_id;
 
 	Map*		private_endpoints;
+	struct _Pool*	pool;		//If set, server lists are shared with the pool
 	List*		active_servers;
 	List*		deactive_servers;
 	
 	Map*		sessions;
+	uint32_t	max_sessions;	//0 is unlimited
+	uint64_t	reject_count;
+	uint8_t		max_ejection;	//Max percent of outlier ejected servers
+	bool		syn_proxy;	//Answer SYN with cookie, connect server after ACK
+	struct _RateLimit*	ratelimit;	//Per client limit. NULL is disable
+	struct _Persist*	persist;	//Client affinity. NULL is disable
+	bool		stateless;	//DR without session. Server is picked by consistent hash
+	struct _Maglev*	maglev;
+	bool		pickup;		//TCP flow is placed by consistent hash so that mid-stream packet recreates its session
+	bool		one_packet;	//UDP datagram is scheduled alone without session
+	Map*		ops;		//NetworkInterface -> one-packet port ring
+	uint32_t	ops_size;	//Ports of ring
+	bool		ops_id;		//Reply must echo first 2 bytes of request
+	struct _Service6*	ipv6;	//IPv6 address of service. NULL is disable
+	struct _Quic*	quic;		//Route by server id in QUIC connection ID. NULL is disable
+	struct _Shaper*	shaper;		//Packet and bandwidth limit of both directions. NULL is disable
 
 	uint8_t		schedule;
+	uint8_t		priority;	//Tier being scheduled. Set by schedule_set_priority
 	Server*		(*next)(struct _Service*, Endpoint* client_endpoint);
 	void*		priv;
 } Service;
 
+//Prefix and port range services are found by classifier instead of exact map
+static inline bool service_is_range(Service* service) {
+	return service->prefix != 32 || service->port_end != service->endpoint.port;
+}
 
 Service* service_alloc(Endpoint* service_endpoint);
+bool service_set_range(Service* service, uint8_t prefix, uint16_t port_end);
 bool service_set_schedule(Service* service, uint8_t schedule);
+bool service_set_stateless(Service* service, bool stateless);
+bool service_set_pickup(Service* service, bool pickup);
+bool service_set_ipv6(Service* service, uint8_t* addr);
+bool service_set_quic(Service* service, bool quic);
+bool service_set_one_packet(Service* service, bool one_packet, uint32_t size, bool match_id);
+void service_set_max_sessions(Service* service, uint32_t max_sessions);
+bool service_set_ratelimit(Service* service, uint32_t rate, uint32_t burst, uint32_t max_sessions, uint32_t size);
+void service_set_syn_proxy(Service* service, bool syn_proxy);
+bool service_set_max_ejection(Service* service, uint8_t max_ejection);
+bool service_set_persist(Service* service, uint64_t timeout, uint8_t prefix, uint32_t size);
+bool service_set_pool(Service* service, struct _Pool* pool);
+bool service_set_shaper(Service* service, uint64_t pps, uint64_t bps, uint8_t action);
 
 bool service_add_private_addr(Service* service, Endpoint* private_endpoint);
 bool service_set_private_addr(Service* service, Endpoint* private_endpoint);
@@ -47,7 +86,8 @@ bool service_free(Service* service);
 Service* service_get(Endpoint* service_endpoint);
 bool service_empty(NetworkInterface* ni);
 
-Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint);
+Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet);
+Session* service_restore_session(Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* server_endpoint, uint16_t nat_port);
 Session* service_get_session(Endpoint* client_endpoint);
 bool service_free_session(Session* session);
 
@@ -8,6 +8,11 @@
 #define SESSION_IN	1
 #define SESSION_OUT	2
 
+#define SESSION_LATENCY_NONE	0
+#define SESSION_LATENCY_SYN	1
+#define SESSION_LATENCY_REQUEST	2
+#define SESSION_LATENCY_DONE	3
+
 #define SESSIONS	"net.lb.sessions"
 
 typedef struct _Session {
@@ -15,9 +20,26 @@ typedef struct _Session {
 	Endpoint*	public_endpoint;
 	Endpoint	client_endpoint;
 	Endpoint	private_endpoint;
+	uint32_t	private_addr;	//Address of loadbalancer on NIC of server
+	uint64_t	sync_time;	//Last announce to standby(us). 0 is not synchronized
+	struct _Shaper*	service_shaper;	//Taken when session is created
+	struct _Shaper*	server_shaper;
+	Endpoint	vip;		//Address client reached. Public endpoint of prefix or port range service
 
 	uint64_t	event_id;
 	bool		fin;
+	bool		limited;	//Counted by rate limit of service
+
+	uint8_t		latency_state;
+	uint64_t	latency_time;
+	uint64_t	deadline_id;	//Outlier detection waits for SYN-ACK or UDP reply
+
+	uint8_t		proxy_state;	//SYN proxy
+	uint32_t	seq_delta;
+	Packet*		proxy_packet;	//Client ACK held until server answers
+
+	struct _Tunnel*	tunnel;		//Outer header template of server in tunnel mode
+	uint32_t	tunnel_source;
 	
 	bool(*translate)(struct _Session* session, Packet* packet);
 	bool(*untranslate)(struct _Session* session, Packet* packet);
@@ -28,6 +50,9 @@ bool session_recharge(Session* session); //move in untranslate & translate
 //bool session_free(Session* session);
 bool session_set_fin(Session* session); //move in untranslate
 uint64_t session_get_private_key(Session* session);
+void session_latency_request(Session* session, Packet* packet); //client -> server
+void session_latency_response(Session* session, Packet* packet); //server -> client
+void session_deadline_stop(Session* session);
 uint64_t session_get_public_key(Session* session);
 
 #endif /*__SESSION_H__*/
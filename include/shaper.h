@@ -0,0 +1,50 @@
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/packet.h>
+
+#define SHAPER_MAX_THREADS	16
+#define SHAPER_BURST		10000	//us. Tokens of this period are kept at most
+#define SHAPER_REBALANCE	100000	//us. Shares of threads follow their demand every period
+#define SHAPER_DSCP		8	//CS1(lower effort) for marked excess
+#define SHAPER_SCALE		1000000	//Token of bucket per second of rate
+
+#define SHAPER_DROP		0
+#define SHAPER_MARK		1
+
+//Token bucket of a thread. Refilled at its share of the rate.
+typedef struct _ShaperBucket {
+	uint64_t	time;		//us. Last refill
+	int64_t		packets;	//Scaled by SHAPER_SCALE so that short refill keeps its fraction
+	int64_t		bytes;
+	uint64_t	pps;		//Share of this thread
+	uint64_t	bps;		//bytes per second
+	uint64_t	demand_packets;	//Since last rebalance
+	uint64_t	demand_bytes;
+	uint64_t	drop_count;
+	uint64_t	mark_count;
+} __attribute__((aligned(64))) ShaperBucket;
+
+typedef struct _Shaper {
+	uint64_t	pps;		//0 is unlimited
+	uint64_t	bps;		//bits per second. 0 is unlimited
+	uint8_t		action;
+	uint64_t	event_id;
+	ShaperBucket	buckets[SHAPER_MAX_THREADS];
+} Shaper;
+
+Shaper* shaper_create(uint64_t pps, uint64_t bps, uint8_t action);
+void shaper_set(Shaper* shaper, uint64_t pps, uint64_t bps, uint8_t action);
+void shaper_destroy(Shaper* shaper);
+bool shaper_process(Shaper* shaper, Packet* packet);
+uint64_t shaper_drop_count(Shaper* shaper);
+uint64_t shaper_mark_count(Shaper* shaper);
+
+//Unshaped service or server costs a NULL check. false is excess to drop.
+static inline bool shaper_pass(Shaper* shaper, Packet* packet) {
+	return !shaper || shaper_process(shaper, packet);
+}
+
+#endif /*__SHAPER_H__*/
@@ -0,0 +1,93 @@
+#ifndef __SYNC_H__
+#define __SYNC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#include "session.h"
+
+#define SYNC_MAX_THREADS	16
+#define SYNC_PORT		8848
+#define SYNC_MAGIC		0x4c42
+#define SYNC_VERSION		1
+#define SYNC_MTU		1400		//Payload of a message
+#define SYNC_FLUSH		10000		//us. Partial message is sent after
+#define SYNC_REFRESH		10000000	//us. Live session is announced again. Shorter than session timeout
+#define SYNC_HEARTBEAT		1000000		//us. Empty message of idle master
+#define SYNC_DEAD		3000000		//us. Backup takes over without message of master
+#define SYNC_PPS		20000		//Default limit of messages
+#define SYNC_BPS		100000000	//Default limit of bits per second
+#define SYNC_GRACE		1000000		//us. Stopped sync is freed after threads are done with it
+
+#define SYNC_NONE		0
+#define SYNC_MASTER		1
+#define SYNC_BACKUP		2
+
+#define SYNC_CREATE		1
+#define SYNC_UPDATE		2
+#define SYNC_DELETE		3
+
+typedef struct _SyncHeader {
+	uint16_t	magic;
+	uint8_t		version;
+	uint8_t		count;
+	uint32_t	sequence;
+} __attribute__ ((packed)) SyncHeader;
+
+//Session by its endpoints. NIC is the index, peers have the same configuration.
+typedef struct _SyncRecord {
+	uint8_t		type;
+	uint8_t		protocol;
+	uint8_t		fin;
+	uint8_t		proxy_state;
+	uint8_t		service_ni;
+	uint8_t		server_ni;
+	uint16_t	service_vlan;
+	uint16_t	server_vlan;
+	uint32_t	client_addr;
+	uint16_t	client_port;
+	uint32_t	service_addr;
+	uint16_t	service_port;
+	uint32_t	server_addr;
+	uint16_t	server_port;
+	uint16_t	nat_port;	//0 is not NAT
+	uint32_t	seq_delta;	//SYN proxy
+} __attribute__ ((packed)) SyncRecord;
+
+//Message being filled by a thread. Only the thread touches it.
+typedef struct _SyncBuffer {
+	Packet*		packet;
+	uint32_t	generation;	//Sync the packet was allocated for
+	uint8_t		count;
+	uint64_t	time;		//us. First record
+} __attribute__((aligned(64))) SyncBuffer;
+
+typedef struct _Sync {
+	uint32_t	generation;	//Differs for every start
+	uint8_t		role;
+	NetworkInterface*	ni;	//Dedicated to synchronization
+	uint32_t	addr;
+	uint32_t	peer;
+	struct _Shaper*	shaper;
+	uint32_t	sequence;
+	uint32_t	peer_sequence;
+	uint64_t	last_send;
+	uint64_t	last_receive;
+
+	uint64_t	send_count;	//Records
+	uint64_t	receive_count;
+	uint64_t	lost_count;	//Messages missed by sequence
+	uint64_t	fail_count;	//Records without service, server or session
+} Sync;
+
+bool sync_start(uint8_t role, NetworkInterface* ni, uint32_t addr, uint32_t peer, uint64_t pps, uint64_t bps);
+void sync_stop();
+void sync_session(Session* session, uint8_t type);
+void sync_refresh(Session* session);
+bool sync_process(Packet* packet);
+void sync_loop();
+void sync_dump();
+
+#endif /*__SYNC_H__*/
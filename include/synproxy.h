@@ -0,0 +1,30 @@
+#ifndef __SYNPROXY_H__
+#define __SYNPROXY_H__
+
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/tcp.h>
+
+#include "session.h"
+#include "endpoint.h"
+
+#define SYNPROXY_NONE		0
+#define SYNPROXY_CONNECT	1	//SYN sent to server. Client ACK is held
+#define SYNPROXY_ESTABLISHED	2	//Sequence numbers of server are shifted by seq_delta
+
+void synproxy_init();
+bool synproxy_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet);
+void synproxy_retransmit(Session* session);
+bool synproxy_connected(Session* session, Packet* packet);
+
+//Client sees cookie as ISN of server. Shift sequence space of server.
+static inline void synproxy_translate(Session* session, TCP* tcp) {
+	if(tcp->ack)
+		tcp->acknowledgement = endian32(endian32(tcp->acknowledgement) + session->seq_delta);
+}
+
+static inline void synproxy_untranslate(Session* session, TCP* tcp) {
+	tcp->sequence = endian32(endian32(tcp->sequence) - session->seq_delta);
+}
+
+#endif /*__SYNPROXY_H__*/
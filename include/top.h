@@ -0,0 +1,38 @@
+#ifndef __TOP_H__
+#define __TOP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "endpoint.h"
+
+#define TOP_MAX_THREADS	16
+#define TOP_SIZE	256	//Counters per tracker. Power of 2
+#define TOP_WAYS	4
+#define TOP_DECAY	10000000	//us. Counters are halved every period
+
+#define TOP_SOURCE	0
+#define TOP_SERVICE	1
+#define TOP_KEYS	2
+
+#define TOP_PACKETS	0
+#define TOP_BYTES	1
+#define TOP_METRICS	2
+
+//Set associative Space-Saving counter
+typedef struct _TopEntry {
+	uint64_t	key;
+	uint64_t	count;
+	uint64_t	error;	//Overestimation inherited on replacement
+} TopEntry;
+
+typedef struct _Top {
+	TopEntry	entries[TOP_KEYS][TOP_METRICS][TOP_SIZE];
+} Top;
+
+bool top_init();
+void top_update(Endpoint* source_endpoint, Endpoint* service_endpoint, uint16_t length);
+void top_dump(uint8_t key, uint8_t metric, uint32_t count);
+void top_reset();
+
+#endif /*__TOP_H__*/
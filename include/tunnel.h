@@ -0,0 +1,35 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "endpoint.h"
+#include "session.h"
+
+#define TUNNEL_IPIP		1
+#define TUNNEL_GUE		2	//GUE variant 1. IP packet directly in UDP
+
+#define TUNNEL_GUE_PORT		6080
+
+//Outer header template of a server. Only length, source and checksum vary per packet.
+typedef struct _Tunnel {
+	uint8_t		type;
+	NetworkInterface*	ni;
+	uint32_t	addr;		//Server
+	uint16_t	length;		//Outer header without ether
+	uint32_t	sum;		//Checksum of template IP header
+	uint8_t		header[IP_LEN + UDP_LEN];
+} Tunnel;
+
+Tunnel* tunnel_create(Endpoint* server_endpoint, uint8_t type, uint16_t port);
+void tunnel_destroy(Tunnel* tunnel);
+bool tunnel_encap(Tunnel* tunnel, uint32_t source, Packet* packet);
+
+Session* tunnel_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint);
+
+#endif /*__TUNNEL_H__*/
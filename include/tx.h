@@ -0,0 +1,28 @@
+#ifndef __TX_H__
+#define __TX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <net/ni.h>
+#include <net/packet.h>
+
+#define TX_MAX_THREADS	16
+#define TX_RETRY	4	//Output attempts before packet is deferred
+#define TX_QUEUE	512	//Deferred packets per thread. Power of 2
+
+typedef struct _TxEntry {
+	NetworkInterface*	ni;
+	Packet*		packet;
+} TxEntry;
+
+//Packets the output ring refused. Sent first on next loop in order.
+typedef struct _TxQueue {
+	uint32_t	head;
+	uint32_t	tail;
+	TxEntry		entries[TX_QUEUE];
+} TxQueue;
+
+bool tx_output(NetworkInterface* ni, Packet* packet);
+void tx_flush();
+
+#endif /*__TX_H__*/
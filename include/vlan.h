@@ -0,0 +1,58 @@
+#ifndef __VLAN_H__
+#define __VLAN_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <net/packet.h>
+#include <net/ether.h>
+
+#define VLAN_LEN	4
+#define VLAN_ID		0x0fff
+
+#ifndef ETHER_TYPE_8021Q
+#define ETHER_TYPE_8021Q	0x8100
+#endif
+
+/*
+ * Tag is removed on ingress and added on egress by moving MAC addresses only.
+ * Every other module sees an untagged frame.
+ */
+static inline uint16_t vlan_pop(Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_8021Q)
+		return 0;
+
+	uint16_t tci;
+	memcpy(&tci, ether->payload, 2);
+	memmove(packet->buffer + packet->start + VLAN_LEN, packet->buffer + packet->start, 12);
+	packet->start += VLAN_LEN;
+
+	return endian16(tci) & VLAN_ID;
+}
+
+static inline bool vlan_push(Packet* packet, uint16_t vlan) {
+	if(!vlan)
+		return true;
+
+	if(packet->start < VLAN_LEN) {
+		if(packet->end + VLAN_LEN > packet->size)
+			return false;
+
+		memmove(packet->buffer + packet->start + VLAN_LEN, packet->buffer + packet->start, packet->end - packet->start);
+		packet->start += VLAN_LEN;
+		packet->end += VLAN_LEN;
+	}
+
+	packet->start -= VLAN_LEN;
+	uint8_t* tag = packet->buffer + packet->start + 12;
+	memmove(packet->buffer + packet->start, packet->buffer + packet->start + VLAN_LEN, 12);
+	uint16_t tpid = endian16(ETHER_TYPE_8021Q);
+	uint16_t tci = endian16(vlan);
+	memcpy(tag, &tpid, 2);
+	memcpy(tag + 2, &tci, 2);
+
+	return true;
+}
+
+#endif /*__VLAN_H__*/
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <util/event.h>
+#include <util/map.h>
+
+#include "classifier.h"
+#include "service.h"
+
+extern void* __gmalloc_pool;
+
+static void classifier_destroy(Classifier* classifier) {
+	if(classifier->tbl24)
+		free(classifier->tbl24);
+	if(classifier->tbl8)
+		free(classifier->tbl8);
+	if(classifier->groups)
+		free(classifier->groups);
+	if(classifier->rules)
+		free(classifier->rules);
+	free(classifier);
+}
+
+static inline uint32_t classifier_entry(Classifier* classifier, uint32_t addr) {
+	uint32_t entry = classifier->tbl24[addr >> 8];
+	if(entry & CLASSIFIER_TBL8)
+		entry = classifier->tbl8[(entry & ~CLASSIFIER_TBL8) << 8 | (addr & 0xff)];
+
+	return entry;
+}
+
+//Narrow port range is more specific. It is checked first.
+static void classifier_rule_insert(ClassifierRule* rules, uint32_t count, Service* service) {
+	uint32_t width = service->port_end - service->endpoint.port;
+	uint32_t i = count;
+	while(i > 0 && (uint32_t)(rules[i - 1].port_end - rules[i - 1].port_start) > width) {
+		rules[i] = rules[i - 1];
+		i--;
+	}
+
+	rules[i].port_start = service->endpoint.port;
+	rules[i].port_end = service->port_end;
+	rules[i].protocol = service->endpoint.protocol;
+	rules[i].vlan = service->endpoint.vlan;
+	rules[i].service = service;
+}
+
+//Shorter prefix is painted first so that longer one overwrites it and links it as parent
+static bool classifier_paint(Classifier* classifier) {
+	uint32_t next = 0;
+	for(uint8_t prefix = 0; prefix <= 32; prefix++) {
+		if(prefix == 25) {
+			//Every /24 holding a longer prefix gets its own tbl8 block
+			for(uint32_t i = 0; i < classifier->group_count; i++) {
+				ClassifierGroup* group = &classifier->groups[i];
+				if(group->prefix <= 24)
+					continue;
+
+				uint32_t* entry = &classifier->tbl24[group->addr >> 8];
+				if(!(*entry & CLASSIFIER_PENDING)) {
+					*entry |= CLASSIFIER_PENDING;
+					classifier->tbl8_count++;
+				}
+			}
+
+			if(classifier->tbl8_count) {
+				classifier->tbl8 = malloc(sizeof(uint32_t) * 256 * classifier->tbl8_count);
+				if(!classifier->tbl8)
+					return false;
+			}
+		}
+
+		for(uint32_t i = 0; i < classifier->group_count; i++) {
+			ClassifierGroup* group = &classifier->groups[i];
+			if(group->prefix != prefix)
+				continue;
+
+			if(prefix <= 24) {
+				group->parent = classifier->tbl24[group->addr >> 8];
+				uint32_t start = group->addr >> 8;
+				uint32_t end = start + (1 << (24 - prefix));
+				for(uint32_t j = start; j < end; j++)
+					classifier->tbl24[j] = i + 1;
+			} else {
+				uint32_t* entry = &classifier->tbl24[group->addr >> 8];
+				if(*entry & CLASSIFIER_PENDING) {
+					uint32_t* block = &classifier->tbl8[next << 8];
+					for(int j = 0; j < 256; j++)
+						block[j] = *entry & ~CLASSIFIER_PENDING;
+					*entry = CLASSIFIER_TBL8 | next++;
+				}
+
+				group->parent = classifier_entry(classifier, group->addr);
+				uint32_t* block = &classifier->tbl8[(*entry & ~CLASSIFIER_TBL8) << 8];
+				uint32_t start = group->addr & 0xff;
+				uint32_t end = start + (1 << (32 - prefix));
+				for(uint32_t j = start; j < end; j++)
+					block[j] = i + 1;
+			}
+		}
+	}
+
+	return true;
+}
+
+static Classifier* classifier_create(Map* services, uint32_t count) {
+	Classifier* classifier = malloc(sizeof(Classifier));
+	if(!classifier)
+		return NULL;
+	bzero(classifier, sizeof(Classifier));
+
+	classifier->tbl24 = malloc(sizeof(uint32_t) << 24);
+	classifier->groups = malloc(sizeof(ClassifierGroup) * count);
+	classifier->rules = malloc(sizeof(ClassifierRule) * count);
+	Map* keys = map_create(count, NULL, NULL, __gmalloc_pool);
+	if(!classifier->tbl24 || !classifier->groups || !classifier->rules || !keys)
+		goto fail;
+	bzero(classifier->tbl24, sizeof(uint32_t) << 24);
+	classifier->rule_count = count;
+
+	//Group services by prefix and count their rules
+	MapIterator iter;
+	map_iterator_init(&iter, services);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		Service* service = entry->data;
+		if(!service_is_range(service))
+			continue;
+
+		uint64_t key = (uint64_t)service->prefix << 32 | service->endpoint.addr;
+		uint32_t index = (uint32_t)(uintptr_t)map_get(keys, (void*)key);
+		if(!index) {
+			ClassifierGroup* group = &classifier->groups[classifier->group_count];
+			bzero(group, sizeof(ClassifierGroup));
+			group->addr = service->endpoint.addr;
+			group->prefix = service->prefix;
+			index = ++classifier->group_count;
+			if(!map_put(keys, (void*)key, (void*)(uintptr_t)index))
+				goto fail;
+		}
+
+		classifier->groups[index - 1].rule_count++;
+	}
+
+	//Port range array of each group is contiguous
+	uint32_t start = 0;
+	for(uint32_t i = 0; i < classifier->group_count; i++) {
+		classifier->groups[i].rule_start = start;
+		start += classifier->groups[i].rule_count;
+		classifier->groups[i].rule_count = 0;
+	}
+
+	map_iterator_init(&iter, services);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		Service* service = entry->data;
+		if(!service_is_range(service))
+			continue;
+
+		uint64_t key = (uint64_t)service->prefix << 32 | service->endpoint.addr;
+		uint32_t index = (uint32_t)(uintptr_t)map_get(keys, (void*)key);
+		ClassifierGroup* group = &classifier->groups[index - 1];
+		classifier_rule_insert(&classifier->rules[group->rule_start], group->rule_count++, service);
+	}
+
+	if(!classifier_paint(classifier))
+		goto fail;
+
+	map_destroy(keys);
+
+	return classifier;
+
+fail:
+	if(keys)
+		map_destroy(keys);
+	classifier_destroy(classifier);
+
+	return NULL;
+}
+
+//Lookup in progress keeps using old table until grace time passes
+static void classifier_publish(Classifier** holder, Classifier* classifier) {
+	bool classifier_free_event(void* context) {
+		classifier_destroy(context);
+
+		return false;
+	}
+
+	Classifier* old = __atomic_exchange_n(holder, classifier, __ATOMIC_ACQ_REL);
+	if(old && !event_timer_add(classifier_free_event, old, CLASSIFIER_GRACE, 0))
+		classifier_destroy(old);
+}
+
+//Compile prefix and port range services of NIC and swap the table in one store
+bool classifier_build(NetworkInterface* ni) {
+	Classifier** holder = ni_config_get(ni, CLASSIFIER);
+	if(!holder) {
+		holder = malloc(sizeof(Classifier*));
+		if(!holder)
+			return false;
+		*holder = NULL;
+
+		if(!ni_config_put(ni, CLASSIFIER, holder)) {
+			free(holder);
+			return false;
+		}
+	}
+
+	Map* services = ni_config_get(ni, SERVICES);
+	uint32_t count = 0;
+	if(services) {
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			if(service_is_range(entry->data))
+				count++;
+		}
+	}
+
+	Classifier* classifier = NULL;
+	if(count) {
+		classifier = classifier_create(services, count);
+		if(!classifier)
+			return false;
+	}
+
+	classifier_publish(holder, classifier);
+
+	return true;
+}
+
+//No range service matches until next build. Used when table can't be rebuilt without a freed service.
+void classifier_clear(NetworkInterface* ni) {
+	Classifier** holder = ni_config_get(ni, CLASSIFIER);
+	if(holder)
+		classifier_publish(holder, NULL);
+}
+
+//Longest prefix first, then its port ranges, then covering prefixes
+Service* classifier_get(Endpoint* endpoint) {
+	Classifier** holder = ni_config_get(endpoint->ni, CLASSIFIER);
+	if(!holder)
+		return NULL;
+
+	Classifier* classifier = __atomic_load_n(holder, __ATOMIC_ACQUIRE);
+	if(!classifier)
+		return NULL;
+
+	uint32_t index = classifier_entry(classifier, endpoint->addr);
+	while(index) {
+		ClassifierGroup* group = &classifier->groups[index - 1];
+		ClassifierRule* rules = &classifier->rules[group->rule_start];
+		for(uint32_t i = 0; i < group->rule_count; i++) {
+			ClassifierRule* rule = &rules[i];
+			if(rule->protocol == endpoint->protocol && rule->vlan == endpoint->vlan &&
+					endpoint->port >= rule->port_start && endpoint->port <= rule->port_end)
+				return rule->service;
+		}
+
+		index = group->parent;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/event.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+#include "cluster.h"
+#include "loadbalancer.h"
+#include "service.h"
+#include "maglev.h"
+#include "tunnel.h"
+#include "neighbor.h"
+#include "drop.h"
+
+static Cluster* current;
+
+static void cluster_table_destroy(ClusterTable* table) {
+	for(uint32_t i = 0; i < table->count; i++) {
+		if(table->tunnels[i])
+			tunnel_destroy(table->tunnels[i]);
+	}
+	free(table);
+}
+
+//Members are sorted so that instances populate the same table regardless of order of configuration
+static ClusterTable* cluster_table_create(NetworkInterface* ni, uint32_t addr, uint32_t* members, uint32_t count) {
+	ClusterTable* table = malloc(sizeof(ClusterTable));
+	if(!table)
+		return NULL;
+	bzero(table, sizeof(ClusterTable));
+
+	for(uint32_t i = 0; i < count && table->count < CLUSTER_MAX_MEMBERS; i++) {
+		uint32_t j = table->count;
+		while(j > 0 && table->members[j - 1] > members[i])
+			j--;
+		if(j > 0 && table->members[j - 1] == members[i])
+			continue;
+
+		memmove(&table->members[j + 1], &table->members[j], sizeof(uint32_t) * (table->count - j));
+		table->members[j] = members[i];
+		table->count++;
+	}
+
+	uint64_t keys[CLUSTER_MAX_MEMBERS];
+	for(uint32_t i = 0; i < table->count; i++) {
+		keys[i] = table->members[i];
+		if(table->members[i] == addr)
+			continue;
+
+		Endpoint endpoint = {
+			.ni = ni,
+			.addr = table->members[i],
+		};
+		table->tunnels[i] = tunnel_create(&endpoint, TUNNEL_IPIP, 0);
+		if(!table->tunnels[i]) {
+			cluster_table_destroy(table);
+			return NULL;
+		}
+	}
+
+	for(uint32_t i = 0; i < CLUSTER_SIZE; i++)
+		table->lookup[i] = UINT16_MAX;
+	maglev_populate(keys, NULL, table->count, CLUSTER_SIZE, table->lookup);
+
+	return table;
+}
+
+static inline uint32_t cluster_table_owner(ClusterTable* table, uint64_t hash) {
+	uint16_t index = table->lookup[hash % CLUSTER_SIZE];
+
+	return index < table->count ? table->members[index] : 0;
+}
+
+static bool cluster_table_contains(ClusterTable* table, uint32_t addr) {
+	for(uint32_t i = 0; i < table->count; i++) {
+		if(table->members[i] == addr)
+			return true;
+	}
+
+	return false;
+}
+
+static Tunnel* cluster_table_tunnel(ClusterTable* table, uint32_t addr) {
+	for(uint32_t i = 0; i < table->count; i++) {
+		if(table->members[i] == addr)
+			return table->tunnels[i];
+	}
+
+	return NULL;
+}
+
+//Current members of old cluster become previous table. Instances of the same members build the same cluster.
+Cluster* cluster_create(NetworkInterface* ni, uint32_t addr, uint32_t* members, uint32_t count, Cluster* old) {
+	Cluster* cluster = malloc(sizeof(Cluster));
+	if(!cluster)
+		return NULL;
+	bzero(cluster, sizeof(Cluster));
+
+	cluster->ni = ni;
+	cluster->addr = addr;
+	cluster->current = cluster_table_create(ni, addr, members, count);
+	if(!cluster->current)
+		goto fail;
+
+	if(old && old->current->count) {
+		cluster->previous = cluster_table_create(ni, addr, old->current->members, old->current->count);
+		if(!cluster->previous)
+			goto fail;
+
+		cluster->transition_end = timer_us() + CLUSTER_TRANSITION;
+		cluster->redirect_count = old->redirect_count;
+		cluster->receive_count = old->receive_count;
+	}
+
+	return cluster;
+
+fail:
+	cluster_destroy(cluster);
+
+	return NULL;
+}
+
+void cluster_destroy(Cluster* cluster) {
+	if(cluster->current)
+		cluster_table_destroy(cluster->current);
+	if(cluster->previous)
+		cluster_table_destroy(cluster->previous);
+	free(cluster);
+}
+
+/*
+ * Next instance a flow without session is sent to. 0 is this instance.
+ * New flow goes to its current owner. Other packets are chained through
+ * previous owner, which has sessions started before membership changed,
+ * then current owner, which has sessions started after.
+ */
+uint32_t cluster_next(Cluster* cluster, uint64_t hash, bool is_new, uint8_t redirects) {
+	if(redirects >= CLUSTER_REDIRECTS)
+		return 0;
+
+	uint32_t owner = cluster_table_owner(cluster->current, hash);
+	uint32_t previous = 0;
+	if(!is_new && cluster->previous && timer_us() < cluster->transition_end)
+		previous = cluster_table_owner(cluster->previous, hash);
+
+	uint32_t next = owner;
+	if(previous && previous != owner && !redirects && previous != cluster->addr)
+		next = previous;
+
+	return next == cluster->addr ? 0 : next;
+}
+
+//Replace published cluster. Lookup in progress keeps using old one until grace time passes.
+static void cluster_publish(Cluster* cluster) {
+	bool cluster_free_event(void* context) {
+		cluster_destroy(context);
+
+		return false;
+	}
+
+	Cluster* old = __atomic_exchange_n(&current, cluster, __ATOMIC_ACQ_REL);
+	if(old && !event_timer_add(cluster_free_event, old, CLUSTER_GRACE, 0))
+		cluster_destroy(old);
+}
+
+bool cluster_start(NetworkInterface* ni, uint32_t addr) {
+	if(!ni_ip_get(ni, addr)) {
+		if(!ni_ip_add(ni, addr))
+			return false;
+	}
+
+	Cluster* cluster = cluster_create(ni, addr, &addr, 1, NULL);
+	if(!cluster)
+		return false;
+
+	cluster_publish(cluster);
+
+	return true;
+}
+
+void cluster_stop() {
+	cluster_publish(NULL);
+}
+
+bool cluster_add(uint32_t addr) {
+	Cluster* old = current;
+	if(!old || old->current->count >= CLUSTER_MAX_MEMBERS || cluster_table_contains(old->current, addr))
+		return false;
+
+	uint32_t members[CLUSTER_MAX_MEMBERS];
+	uint32_t count = old->current->count;
+	memcpy(members, old->current->members, sizeof(uint32_t) * count);
+	members[count++] = addr;
+
+	Cluster* cluster = cluster_create(old->ni, old->addr, members, count, old);
+	if(!cluster)
+		return false;
+
+	cluster_publish(cluster);
+
+	return true;
+}
+
+bool cluster_remove(uint32_t addr) {
+	Cluster* old = current;
+	if(!old || addr == old->addr)
+		return false;
+
+	uint32_t members[CLUSTER_MAX_MEMBERS];
+	uint32_t count = 0;
+	for(uint32_t i = 0; i < old->current->count; i++) {
+		if(old->current->members[i] != addr)
+			members[count++] = old->current->members[i];
+	}
+
+	if(count == old->current->count)
+		return false;
+
+	Cluster* cluster = cluster_create(old->ni, old->addr, members, count, old);
+	if(!cluster)
+		return false;
+
+	cluster_publish(cluster);
+
+	return true;
+}
+
+/*
+ * Strip IPIP header of packet redirected by another instance.
+ * Returns how many times the packet was redirected, 0 is not redirected.
+ */
+uint8_t cluster_decap(Packet* packet) {
+	Cluster* cluster = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if(!cluster || packet->ni != cluster->ni)
+		return 0;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+		return 0;
+
+	IP* ip = (IP*)ether->payload;
+	if(ip->protocol != IP_PROTOCOL_IP || endian32(ip->destination) != cluster->addr)
+		return 0;
+
+	uint32_t source = endian32(ip->source);
+	if(!cluster_table_contains(cluster->current, source) &&
+			!(cluster->previous && cluster_table_contains(cluster->previous, source)))
+		return 0;
+
+	uint16_t push = ip->ihl * 4;
+	IP* inner = (IP*)((uint8_t*)ip + push);
+	if(packet->start + ETHER_LEN + push + IP_LEN > packet->end || inner->version != 4)
+		return 0;
+
+	uint8_t redirects = ip->ttl < CLUSTER_TTL ? CLUSTER_TTL - ip->ttl + 1 : 1;
+	memmove(packet->buffer + packet->start + push, ether, ETHER_LEN);
+	packet->start += push;
+	cluster->receive_count++;
+
+	return redirects;
+}
+
+//TCP packet without session goes to the instance that owns the flow instead of being scheduled here
+bool cluster_redirect(Endpoint* service_endpoint, Endpoint* client_endpoint, uint8_t redirects, Packet* packet) {
+	Cluster* cluster = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if(!cluster || packet->ni != cluster->ni || client_endpoint->protocol != IP_PROTOCOL_TCP)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+	bool is_new = tcp->syn && !tcp->ack;
+	uint32_t next = cluster_next(cluster, maglev_hash(client_endpoint, service_endpoint), is_new, redirects);
+	if(!next || !service_get(service_endpoint))
+		return false;
+
+	Tunnel* tunnel = cluster_table_tunnel(cluster->current, next);
+	if(!tunnel && cluster->previous)
+		tunnel = cluster_table_tunnel(cluster->previous, next);
+	if(!tunnel)
+		return false;
+
+	if(!tunnel_encap(tunnel, cluster->addr, packet)) {
+		drop_packet(packet, DROP_HEADROOM);
+		return true;
+	}
+
+	//Outer TTL counts redirects. It is the only field differing from template.
+	if(redirects) {
+		ether = (Ether*)(packet->buffer + packet->start);
+		IP* outer = (IP*)ether->payload;
+		uint16_t old = outer->ttl << 8 | outer->protocol;
+		outer->ttl = CLUSTER_TTL - redirects;
+		uint32_t sum = lb_checksum_adjust((uint16_t)~endian16(outer->checksum), old, outer->ttl << 8 | outer->protocol);
+		outer->checksum = endian16(lb_checksum_fold(sum));
+	}
+
+	cluster->redirect_count++;
+	neighbor_output(cluster->ni, next, cluster->addr, client_endpoint->vlan, packet);
+
+	return true;
+}
+
+void cluster_dump() {
+	Cluster* cluster = current;
+	if(!cluster) {
+		printf("Cluster is off\n");
+		return;
+	}
+
+	void print_addr(uint32_t addr) {
+		printf("%d.%d.%d.%d\t", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+	}
+
+	uint64_t now = timer_us();
+	bool is_changing = cluster->previous && now < cluster->transition_end;
+
+	printf("Instance\tState\n");
+	for(uint32_t i = 0; i < cluster->current->count; i++) {
+		uint32_t addr = cluster->current->members[i];
+		print_addr(addr);
+		if(addr == cluster->addr)
+			printf("SELF\n");
+		else if(is_changing && !cluster_table_contains(cluster->previous, addr))
+			printf("JOINING\n");
+		else
+			printf("ACTIVE\n");
+	}
+
+	if(is_changing) {
+		for(uint32_t i = 0; i < cluster->previous->count; i++) {
+			uint32_t addr = cluster->previous->members[i];
+			if(addr == cluster->addr || cluster_table_contains(cluster->current, addr))
+				continue;
+
+			print_addr(addr);
+			printf("LEAVING\n");
+		}
+
+		printf("Transition ends in %ld seconds\n", (cluster->transition_end - now) / 1000000);
+	}
+
+	uint16_t index = 0;
+	while(index < ni_count() && ni_get(index) != cluster->ni)
+		index++;
+
+	printf("NIC\tRedirected\tReceived\n");
+	printf("%d\t%ld\t\t%ld\n", index, cluster->redirect_count, cluster->receive_count);
+}
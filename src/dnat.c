@@ -13,6 +13,7 @@
 #include "service.h"
 #include "server.h"
 #include "session.h"
+#include "synproxy.h"
 
 static bool dnat_free(Session* session);
 static bool dnat_tcp_translate(Session* session, Packet* translateet);
@@ -33,6 +34,7 @@ Session* dnat_tcp_session_alloc(Endpoint* server_endpoint, Endpoint* service_end
 	memcpy(&session->client_endpoint, client_endpoint, sizeof(Endpoint));
 	memcpy(&session->private_endpoint, client_endpoint, sizeof(Endpoint));
 
+	session->tunnel = NULL;
 	session->event_id = 0;
 	session_recharge(session);
 
@@ -58,6 +60,7 @@ Session* dnat_udp_session_alloc(Endpoint* server_endpoint, Endpoint* service_end
 	memcpy(&session->client_endpoint, client_endpoint, sizeof(Endpoint));
 	memcpy(&session->private_endpoint, client_endpoint, sizeof(Endpoint));
 
+	session->tunnel = NULL;
 	session->event_id = 0;
 	session_recharge(session);
 
@@ -84,10 +87,13 @@ static bool dnat_tcp_translate(Session* session, Packet* translateet) {
 	TCP* tcp = (TCP*)ip->body;
 
 	ether->smac = endian48(server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, session->private_endpoint.addr, server_endpoint->addr));
+	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, server_endpoint->addr, session->private_addr));
 
 	ip->destination = endian32(server_endpoint->addr);
 	tcp->destination = endian16(server_endpoint->port);
+	session_latency_request(session, translateet);
+	if(session->proxy_state)
+		synproxy_translate(session, tcp);
 
 	tcp_pack(translateet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 	if(session->fin && tcp->ack)
@@ -105,10 +111,11 @@ static bool dnat_udp_translate(Session* session, Packet* translateet) {
 	UDP* udp = (UDP*)ip->body;
 
 	ether->smac = endian48(server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, session->private_endpoint.addr, server_endpoint->addr));
+	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, server_endpoint->addr, session->private_addr));
 
 	ip->destination = endian32(server_endpoint->addr);
 	udp->destination = endian16(server_endpoint->port);
+	session_latency_request(session, translateet);
 
 	udp_pack(translateet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
 
@@ -124,9 +131,12 @@ static bool dnat_tcp_untranslate(Session* session, Packet* translateet) {
 	TCP* tcp = (TCP*)ip->body;
 
 	ether->smac = endian48(public_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(public_endpoint->ni, public_endpoint->addr, session->client_endpoint.addr));
+	ether->dmac = endian48(arp_get_mac(public_endpoint->ni, session->client_endpoint.addr, public_endpoint->addr));
 	//ip->source = endian32(public_endpoint->addr);
 	//tcp->source = endian16(public_endpoint->port);
+	session_latency_response(session, translateet);
+	if(session->proxy_state)
+		synproxy_untranslate(session, tcp);
 
 	tcp_pack(translateet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 		
@@ -145,9 +155,10 @@ static bool dnat_udp_untranslate(Session* session, Packet* translateet) {
 	//UDP* udp = (UDP*)ip->body;
 
 	ether->smac = endian48(public_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(public_endpoint->ni, public_endpoint->addr, session->client_endpoint.addr));
+	ether->dmac = endian48(arp_get_mac(public_endpoint->ni, session->client_endpoint.addr, public_endpoint->addr));
 	//ip->source = endian32(public_endpoint->addr);
 	//udp->source = endian16(public_endpoint->port);
+	session_latency_response(session, translateet);
 
 	udp_pack(translateet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
 
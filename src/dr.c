@@ -6,11 +6,21 @@
 #include <net/packet.h>
 #include <net/ether.h>
 #include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
 
 #include "dr.h"
 #include "endpoint.h"
 #include "session.h"
 #include "server.h"
+#include "service.h"
+#include "pool.h"
+#include "maglev.h"
+#include "tunnel.h"
+#include "vlan.h"
+#include "neighbor.h"
+#include "drop.h"
+#include "shaper.h"
 
 static bool dr_translate(Session* session, Packet* packet);
 static bool dr_untranslate(Session* session, Packet* packet);
@@ -29,6 +39,7 @@ Session* dr_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint,
 	memcpy(&session->client_endpoint, client_endpoint, sizeof(Endpoint));
 	memcpy(&session->private_endpoint, client_endpoint, sizeof(Endpoint));
 
+	session->tunnel = NULL;
 	session->event_id = 0;
 	session_recharge(session);
 	session->fin = false;
@@ -51,7 +62,7 @@ static bool dr_translate(Session* session, Packet* packet) {
 
 	Endpoint* server_endpoint = session->server_endpoint;
 	ether->smac = endian48(server_endpoint->ni->mac);
-	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, session->private_endpoint.addr, server_endpoint->addr));
+	ether->dmac = endian48(arp_get_mac(server_endpoint->ni, server_endpoint->addr, session->private_addr));
 	session_recharge(session);
 
 	return true;
@@ -62,3 +73,47 @@ static bool dr_untranslate(Session* session, Packet* packet) {
 	return true;
 }
 
+
+//Stateless DR. No session is created, every packet picks server by consistent hash of its flow
+bool dr_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
+	Service* service = service_get(service_endpoint);
+	if(!service || !service->stateless || service->state != SERVICE_STATE_ACTIVE || !service->private_endpoints)
+		return false;
+
+	//Only TCP SYN is known as new flow. Unseen UDP flow keeps previous mapping while membership is changing
+	bool is_new = false;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	if(ip->protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		is_new = tcp->syn && !tcp->ack;
+	}
+
+	List* servers = service->pool ? service->pool->active_servers : service->active_servers;
+	Server* server = maglev_get(service->maglev, servers, maglev_hash(client_endpoint, service_endpoint), is_new);
+	if(!server || (server->mode != MODE_DR && server->mode != MODE_TUNNEL))
+		return false;
+
+	Endpoint* private_endpoint = map_get(service->private_endpoints, server->endpoint.ni);
+	if(!private_endpoint)
+		return false;
+
+	if(!shaper_pass(service->shaper, packet) || !shaper_pass(server->shaper, packet)) {
+		drop_packet(packet, DROP_SHAPED);
+		return true;
+	}
+
+	if(server->mode == MODE_TUNNEL) {
+		if(!tunnel_encap(server->tunnel, private_endpoint->addr, packet)) {
+			drop_packet(packet, DROP_HEADROOM);
+			return true;
+		}
+	} else {
+		ether->smac = endian48(server->endpoint.ni->mac);
+		ether->dmac = endian48(arp_get_mac(server->endpoint.ni, server->endpoint.addr, private_endpoint->addr));
+	}
+
+	neighbor_output(server->endpoint.ni, server->endpoint.addr, private_endpoint->addr, server->endpoint.vlan, packet);
+
+	return true;
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+#include <thread.h>
+#include <net/ni.h>
+
+#include "drop.h"
+
+static uint64_t drops[DROP_MAX_THREADS][DROP_REASONS];
+
+static const char* reasons[DROP_REASONS] = {
+	"Protocol",
+	"No service",
+	"Reject",
+	"Retransmit",
+	"Invalid",
+	"Fragment",
+	"Neighbor",
+	"Headroom",
+	"TX full",
+	"Shaped",
+};
+
+//Every packet not forwarded nor consumed ends here
+void drop_packet(Packet* packet, uint8_t reason) {
+	int id = thread_id();
+	if(id < DROP_MAX_THREADS && reason < DROP_REASONS)
+		drops[id][reason]++;
+
+	ni_free(packet);
+}
+
+void drop_reset() {
+	bzero(drops, sizeof(drops));
+}
+
+void drop_dump() {
+	printf("Reason\t\tPackets\n");
+	for(int i = 0; i < DROP_REASONS; i++) {
+		uint64_t count = 0;
+		for(int j = 0; j < DROP_MAX_THREADS; j++)
+			count += drops[j][i];
+
+		printf("%-16s%ld\n", reasons[i], count);
+	}
+}
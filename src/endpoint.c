@@ -31,6 +31,7 @@ Endpoint* endpoint_alloc(NetworkInterface* ni, uint32_t addr, uint8_t protocol,
 	endpoint->addr = addr;
 	endpoint->protocol = protocol;
 	endpoint->port = port;
+	endpoint->vlan = 0;
 
 	return endpoint;
 
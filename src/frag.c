@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+#include <net/checksum.h>
+
+#include "frag.h"
+#include "loadbalancer.h"
+#include "tunnel.h"
+#include "vlan.h"
+#include "drop.h"
+#include "tx.h"
+
+static inline uint32_t frag_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline uint32_t frag_hash(uint32_t source, uint32_t destination, uint16_t id, uint8_t protocol) {
+	uint32_t hash = (source ^ (destination * 0x9e3779b1) ^ ((uint32_t)id << 8 | protocol)) * 0x85ebca6b;
+
+	return (hash ^ (hash >> 16)) & (FRAG_SIZE - 1);
+}
+
+static inline bool frag_match(FragEntry* entry, IP* ip) {
+	return entry->ni && entry->source == ip->source && entry->destination == ip->destination &&
+		entry->id == ip->id && entry->protocol == ip->protocol;
+}
+
+static Frag* frag_get(NetworkInterface* ni) {
+	Frag* frag = ni_config_get(ni, FRAGS);
+	if(frag)
+		return frag;
+
+	frag = malloc(sizeof(Frag));
+	if(!frag) {
+		printf("Can'nt allocate fragment table\n");
+		return NULL;
+	}
+	bzero(frag, sizeof(Frag));
+
+	if(!ni_config_put(ni, FRAGS, frag)) {
+		free(frag);
+		return NULL;
+	}
+
+	return frag;
+}
+
+//false is no headroom for outer header
+static bool frag_translate(FragEntry* entry, Packet* packet) {
+	if(entry->tunnel) {
+		if(!tunnel_encap(entry->tunnel, endian32(entry->new_source), packet))
+			return false;
+	} else {
+		Ether* ether = (Ether*)(packet->buffer + packet->start);
+		IP* ip = (IP*)ether->payload;
+
+		ether->smac = entry->smac;
+		ether->dmac = entry->dmac;
+		ip->source = entry->new_source;
+		ip->destination = entry->new_destination;
+		ip->checksum = 0;
+		ip->checksum = endian16(checksum(ip, ip->ihl * 4));
+	}
+
+	vlan_push(packet, entry->vlan);
+
+	return true;
+}
+
+void frag_key(FragKey* key, IP* ip) {
+	key->source = ip->source;
+	key->destination = ip->destination;
+	key->id = ip->id;
+	key->flags_offset = ip->flags_offset;
+	key->protocol = ip->protocol;
+	memcpy(key->header, ip->body, ip->protocol == IP_PROTOCOL_TCP ? TCP_LEN : UDP_LEN);
+}
+
+static inline uint16_t frag_word(void* data, int index) {
+	uint16_t word;
+	memcpy(&word, (uint8_t*)data + index * 2, 2);
+
+	return word;
+}
+
+static uint16_t frag_checksum(uint16_t old_checksum, FragKey* key, IP* ip, void* header, int count, int index) {
+	uint32_t sum = (uint16_t)~old_checksum;
+	//Pseudo header addresses are followed by L4 header
+	void* addrs = (uint8_t*)ip + 12;
+	for(int i = 0; i < 4; i++)
+		sum = lb_checksum_adjust(sum, frag_word(&key->source, i), frag_word(addrs, i));
+
+	for(int i = 0; i < count; i++) {
+		if(i != index)
+			sum = lb_checksum_adjust(sum, frag_word(key->header, i), frag_word(header, i));
+	}
+
+	return lb_checksum_fold(sum);
+}
+
+/*
+ * First fragment is translated by session. Packing covered only this fragment,
+ * so L4 checksum is adjusted from the original instead.
+ */
+void frag_update(FragKey* key, Packet* packet, NetworkInterface* ni, Tunnel* tunnel, uint16_t vlan) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	//Inner packet is not touched by encapsulation
+	if(tunnel)
+		goto record;
+
+	ip->flags_offset = key->flags_offset;
+	if(key->protocol == IP_PROTOCOL_TCP) {
+		TCP* tcp = (TCP*)ip->body;
+		uint16_t old_checksum = ((TCP*)key->header)->checksum;
+		tcp->checksum = frag_checksum(old_checksum, key, ip, tcp, TCP_LEN / 2, 8);
+	} else {
+		UDP* udp = (UDP*)ip->body;
+		uint16_t old_checksum = ((UDP*)key->header)->checksum;
+		udp->length = ((UDP*)key->header)->length;
+		if(old_checksum) {
+			udp->checksum = frag_checksum(old_checksum, key, ip, udp, UDP_LEN / 2, 3);
+			if(!udp->checksum)
+				udp->checksum = 0xffff;
+		} else
+			udp->checksum = 0;
+	}
+	ip->checksum = 0;
+	ip->checksum = endian16(checksum(ip, ip->ihl * 4));
+
+record:
+	;
+	Frag* frag = frag_get(packet->ni);
+	if(!frag)
+		return;
+
+	//Reuse the slot of an expired or the oldest datagram
+	uint32_t now = frag_now();
+	uint32_t index = frag_hash(key->source, key->destination, key->id, key->protocol);
+	FragEntry* entry = NULL;
+	for(int i = 0; i < FRAG_PROBE; i++) {
+		FragEntry* _entry = &frag->entries[(index + i) & (FRAG_SIZE - 1)];
+		if(!_entry->ni || now - _entry->time > FRAG_TIMEOUT) {
+			entry = _entry;
+			break;
+		}
+
+		if(!entry || _entry->time < entry->time)
+			entry = _entry;
+	}
+
+	entry->source = key->source;
+	entry->destination = key->destination;
+	entry->id = key->id;
+	entry->protocol = key->protocol;
+	entry->time = now;
+	entry->ni = ni;
+	entry->smac = ether->smac;
+	entry->dmac = ether->dmac;
+	entry->new_source = ip->source;
+	entry->new_destination = ip->destination;
+	entry->tunnel = tunnel;
+	entry->vlan = vlan;
+
+	//Send fragments arrived earlier
+	for(int i = 0; i < FRAG_HOLD; i++) {
+		FragHold* hold = &frag->holds[i];
+		if(!hold->packet)
+			continue;
+
+		IP* _ip = (IP*)((Ether*)(hold->packet->buffer + hold->packet->start))->payload;
+		if(now - hold->time > FRAG_TIMEOUT) {
+			drop_packet(hold->packet, DROP_FRAGMENT);
+			hold->packet = NULL;
+		} else if(frag_match(entry, _ip)) {
+			if(frag_translate(entry, hold->packet))
+				tx_output(ni, hold->packet);
+			else
+				drop_packet(hold->packet, DROP_HEADROOM);
+			hold->packet = NULL;
+		}
+	}
+}
+
+//Fragment without L4 header follows its first fragment, or waits for it
+bool frag_process(Packet* packet) {
+	Frag* frag = frag_get(packet->ni);
+	if(!frag)
+		return false;
+
+	IP* ip = (IP*)((Ether*)(packet->buffer + packet->start))->payload;
+	uint32_t now = frag_now();
+	uint32_t index = frag_hash(ip->source, ip->destination, ip->id, ip->protocol);
+	for(int i = 0; i < FRAG_PROBE; i++) {
+		FragEntry* entry = &frag->entries[(index + i) & (FRAG_SIZE - 1)];
+		if(!frag_match(entry, ip) || now - entry->time > FRAG_TIMEOUT)
+			continue;
+
+		if(frag_translate(entry, packet))
+			tx_output(entry->ni, packet);
+		else
+			drop_packet(packet, DROP_HEADROOM);
+
+		return true;
+	}
+
+	//Hold in an empty slot, otherwise drop the oldest
+	FragHold* victim = &frag->holds[0];
+	for(int i = 0; i < FRAG_HOLD; i++) {
+		FragHold* hold = &frag->holds[i];
+		if(!hold->packet) {
+			victim = hold;
+			break;
+		}
+
+		if(hold->time < victim->time)
+			victim = hold;
+	}
+
+	if(victim->packet)
+		drop_packet(victim->packet, DROP_FRAGMENT);
+	victim->time = now;
+	victim->packet = packet;
+
+	return true;
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <util/event.h>
+#include <util/map.h>
+#include <util/list.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "health.h"
+#include "server.h"
+#include "service.h"
+#include "pool.h"
+#include "loadbalancer.h"
+#include "neighbor.h"
+
+#define HEALTH_UDP_PAYLOAD	"PacketNgin Loadbalancer Health Check"
+
+static bool health_event(void* context);
+
+//Probes are sent from a private address of a service on the server's NIC
+static bool health_source(Health* health) {
+	bool find(Service* service) {
+		if(!service->private_endpoints)
+			return false;
+
+		Endpoint* private_endpoint = map_get(service->private_endpoints, health->server->endpoint.ni);
+		if(!private_endpoint)
+			return false;
+
+		health->source.ni = private_endpoint->ni;
+		health->source.addr = private_endpoint->addr;
+		health->source.vlan = health->server->endpoint.vlan;
+
+		return true;
+	}
+
+	Server* server = health->server;
+	if(server->pool) {
+		ListIterator iter;
+		list_iterator_init(&iter, server->pool->services);
+		while(list_iterator_has_next(&iter)) {
+			if(find(list_iterator_next(&iter)))
+				return true;
+		}
+
+		return false;
+	}
+
+	uint32_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			if(find(entry->data))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static Packet* health_packet_alloc(Health* health, uint16_t body_len) {
+	Endpoint* server_endpoint = &health->server->endpoint;
+	NetworkInterface* ni = health->source.ni;
+	uint16_t header_len = server_endpoint->protocol == IP_PROTOCOL_TCP ? TCP_LEN : UDP_LEN;
+	uint16_t length = ETHER_LEN + IP_LEN + header_len + body_len;
+
+	Packet* packet = ni_alloc(ni, length);
+	if(!packet)
+		return NULL;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(arp_get_mac(ni, server_endpoint->addr, health->source.addr));
+	ether->smac = endian48(ni->mac);
+	ether->type = endian16(ETHER_TYPE_IPv4);
+
+	IP* ip = (IP*)ether->payload;
+	ip->ihl = IP_LEN / 4;
+	ip->version = 4;
+	ip->ecn = 0;
+	ip->dscp = 0;
+	ip->length = endian16(IP_LEN + header_len + body_len);
+	ip->id = 0;
+	ip->flags_offset = 0;
+	ip->ttl = 64;
+	ip->protocol = server_endpoint->protocol;
+	ip->source = endian32(health->source.addr);
+	ip->destination = endian32(server_endpoint->addr);
+
+	packet->end = packet->start + length;
+
+	return packet;
+}
+
+//Server on tagged VLAN is resolved by ARP of its VLAN
+static void health_output(Health* health, Packet* packet) {
+	neighbor_output(health->source.ni, health->server->endpoint.addr, health->source.addr, health->source.vlan, packet);
+}
+
+static void health_send_tcp(Health* health, bool syn, bool rst, uint32_t acknowledgement, char* payload, uint16_t payload_len) {
+	Packet* packet = health_packet_alloc(health, payload_len);
+	if(!packet)
+		return;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+	bzero(tcp, TCP_LEN);
+	tcp->source = endian16(health->source.port);
+	tcp->destination = endian16(health->server->endpoint.port);
+	tcp->sequence = endian32(health->sequence);
+	tcp->acknowledgement = endian32(acknowledgement);
+	tcp->offset = TCP_LEN / 4;
+	tcp->syn = syn;
+	tcp->rst = rst;
+	tcp->ack = !syn;
+	tcp->psh = !!payload_len;
+	tcp->window = endian16(8192);
+	if(payload_len)
+		memcpy(tcp->payload, payload, payload_len);
+
+	tcp_pack(packet, payload_len);
+	health_output(health, packet);
+}
+
+static void health_send_udp(Health* health) {
+	uint16_t payload_len = sizeof(HEALTH_UDP_PAYLOAD) - 1;
+	Packet* packet = health_packet_alloc(health, payload_len);
+	if(!packet)
+		return;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+	udp->source = endian16(health->source.port);
+	udp->destination = endian16(health->server->endpoint.port);
+	udp->length = endian16(UDP_LEN + payload_len);
+	udp->checksum = 0;
+	memcpy(udp->body, HEALTH_UDP_PAYLOAD, payload_len);
+
+	udp_pack(packet, payload_len);
+	health_output(health, packet);
+}
+
+static bool health_probe_begin(Health* health) {
+	if(!health_source(health))
+		return false;
+
+	Map* healths = ni_config_get(health->source.ni, HEALTHS);
+	if(!healths) {
+		healths = map_create(16, NULL, NULL, health->source.ni->pool);
+		if(!healths)
+			return false;
+		if(!ni_config_put(health->source.ni, HEALTHS, healths))
+			return false;
+	}
+
+	health->source.protocol = health->server->endpoint.protocol;
+	if(health->source.protocol == IP_PROTOCOL_TCP)
+		health->source.port = tcp_port_alloc(health->source.ni, health->source.addr);
+	else
+		health->source.port = udp_port_alloc(health->source.ni, health->source.addr);
+	if(!health->source.port)
+		return false;
+
+	if(!map_put(healths, (void*)endpoint_key(&health->source), health))
+		goto map_put_fail;
+
+	health->state = HEALTH_STATE_CONNECT;
+	if(health->source.protocol == IP_PROTOCOL_TCP) {
+		health->sequence = (uint32_t)cpu_tsc();
+		health_send_tcp(health, true, false, 0, NULL, 0);
+	} else {
+		health_send_udp(health);
+	}
+
+	return true;
+
+map_put_fail:
+	if(health->source.protocol == IP_PROTOCOL_TCP)
+		tcp_port_free(health->source.ni, health->source.addr, health->source.port);
+	else
+		udp_port_free(health->source.ni, health->source.addr, health->source.port);
+
+	return false;
+}
+
+static void health_probe_end(Health* health) {
+	if(health->state == HEALTH_STATE_IDLE)
+		return;
+
+	Map* healths = ni_config_get(health->source.ni, HEALTHS);
+	map_remove(healths, (void*)endpoint_key(&health->source));
+
+	if(health->source.protocol == IP_PROTOCOL_TCP)
+		tcp_port_free(health->source.ni, health->source.addr, health->source.port);
+	else
+		udp_port_free(health->source.ni, health->source.addr, health->source.port);
+
+	health->state = HEALTH_STATE_IDLE;
+}
+
+static void health_result(Health* health, bool success) {
+	Server* server = health->server;
+	health_probe_end(health);
+
+	//Removing server is not brought back
+	if(server->state == SERVER_STATE_DEACTIVE)
+		return;
+
+	if(success) {
+		health->fail_count = 0;
+		if(health->success_count < UINT8_MAX)
+			health->success_count++;
+
+		if(server->state == SERVER_STATE_DOWN && health->success_count >= health->rise) {
+			server_set_state(server, SERVER_STATE_ACTIVE);
+			server_start(server);
+		}
+	} else {
+		health->success_count = 0;
+		if(health->fail_count < UINT8_MAX)
+			health->fail_count++;
+
+		if(server->state == SERVER_STATE_ACTIVE && health->fail_count >= health->fall)
+			server_set_state(server, SERVER_STATE_DOWN);
+	}
+}
+
+static bool health_schedule(Health* health, uint64_t delay) {
+	health->event_id = event_timer_add(health_event, health, delay, 0);
+
+	return !!health->event_id;
+}
+
+static bool health_event(void* context) {
+	Health* health = context;
+	health->event_id = 0;
+
+	//Previous probe is not answered within interval
+	if(health->state != HEALTH_STATE_IDLE)
+		health_result(health, false);
+
+	if(!health_probe_begin(health))
+		health_result(health, false);
+
+	uint64_t delay = health->interval;
+	if(health->jitter)
+		delay += cpu_tsc() % health->jitter;
+	health_schedule(health, delay);
+
+	return false;
+}
+
+bool health_start(Server* server, uint8_t type, uint64_t interval, uint8_t rise, uint8_t fall, uint64_t jitter) {
+	switch(type) {
+		case HEALTH_TCP:
+		case HEALTH_HTTP:
+			if(server->endpoint.protocol != IP_PROTOCOL_TCP)
+				return false;
+			break;
+		case HEALTH_UDP:
+			if(server->endpoint.protocol != IP_PROTOCOL_UDP)
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	if(!interval || !rise || !fall)
+		return false;
+
+	health_stop(server);
+
+	Health* health = malloc(sizeof(Health));
+	if(!health) {
+		printf("Can'nt allocate health check\n");
+		return false;
+	}
+	bzero(health, sizeof(Health));
+
+	health->server = server;
+	health->type = type;
+	health->interval = interval;
+	health->jitter = jitter;
+	health->rise = rise;
+	health->fall = fall;
+	strcpy(health->path, "/");
+
+	//Spread first probes over an interval so thousands of servers never burst
+	if(!health_schedule(health, 1 + cpu_tsc() % interval)) {
+		free(health);
+		return false;
+	}
+
+	server->health = health;
+
+	return true;
+}
+
+bool health_set_path(Server* server, char* path) {
+	Health* health = server->health;
+	if(!health || health->type != HEALTH_HTTP)
+		return false;
+
+	if(strlen(path) >= HEALTH_PATH_SIZE)
+		return false;
+
+	strcpy(health->path, path);
+
+	return true;
+}
+
+void health_stop(Server* server) {
+	Health* health = server->health;
+	if(!health)
+		return;
+
+	if(health->event_id)
+		event_timer_remove(health->event_id);
+
+	health_probe_end(health);
+	free(health);
+	server->health = NULL;
+}
+
+static void health_process_tcp(Health* health, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+	uint16_t payload_len = endian16(ip->length) - ip->ihl * 4 - tcp->offset * 4;
+
+	if(tcp->rst) {
+		health_result(health, false);
+		return;
+	}
+
+	switch(health->state) {
+		case HEALTH_STATE_CONNECT:
+			if(!(tcp->syn && tcp->ack) || endian32(tcp->acknowledgement) != health->sequence + 1)
+				return;
+
+			health->sequence++;
+			if(health->type == HEALTH_TCP) {
+				health_send_tcp(health, false, true, endian32(tcp->sequence) + 1, NULL, 0);
+				health_result(health, true);
+				return;
+			}
+
+			char request[HEALTH_PATH_SIZE + 64];
+			uint32_t addr = health->server->endpoint.addr;
+			int request_len = sprintf(request, "GET %s HTTP/1.0\r\nHost: %d.%d.%d.%d\r\n\r\n", health->path,
+					(addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+			health_send_tcp(health, false, false, endian32(tcp->sequence) + 1, request, request_len);
+			health->sequence += request_len;
+			health->state = HEALTH_STATE_REQUEST;
+			break;
+		case HEALTH_STATE_REQUEST:
+			if(payload_len < 12)
+				return;
+
+			//"HTTP/1.x NNN"
+			char* response = (char*)ip->body + tcp->offset * 4;
+			bool success = !strncmp(response, "HTTP/1.", 7) && (response[9] == '2' || response[9] == '3');
+			health_send_tcp(health, false, true, endian32(tcp->sequence) + payload_len, NULL, 0);
+			health_result(health, success);
+			break;
+	}
+}
+
+bool health_process(Endpoint* destination_endpoint, Packet* packet) {
+	Map* healths = ni_config_get(destination_endpoint->ni, HEALTHS);
+	if(!healths)
+		return false;
+
+	Health* health = map_get(healths, (void*)endpoint_key(destination_endpoint));
+	if(!health)
+		return false;
+
+	if(destination_endpoint->protocol == IP_PROTOCOL_TCP)
+		health_process_tcp(health, packet);
+	else
+		health_result(health, true);
+
+	ni_free(packet);
+
+	return true;
+}
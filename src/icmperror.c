@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <util/map.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/icmp.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+#include <net/checksum.h>
+
+#include "icmperror.h"
+#include "loadbalancer.h"
+#include "service.h"
+#include "server.h"
+#include "session.h"
+#include "vlan.h"
+#include "neighbor.h"
+
+#define ICMP_ERROR_QUOTE	8	//Bytes of L4 header quoted at least
+
+static inline uint16_t icmperror_word(void* data) {
+	uint16_t word;
+	memcpy(&word, data, 2);
+
+	return word;
+}
+
+static inline void icmperror_set_word(void* data, uint16_t word) {
+	memcpy(data, &word, 2);
+}
+
+/*
+ * Rewrite error as if it is about the packet the other side sent.
+ * Quoted L4 header may be truncated, so its checksum is adjusted instead of computed.
+ */
+static void icmperror_translate(Packet* packet, NetworkInterface* ni, uint16_t vlan, uint32_t source, uint32_t destination, Endpoint* inner_source, Endpoint* inner_destination) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	ICMP* icmp = (ICMP*)ip->body;
+	uint16_t icmp_len = endian16(ip->length) - ip->ihl * 4;
+	IP* inner = (IP*)(icmp->body + 4);
+	uint8_t* l4 = (uint8_t*)inner + inner->ihl * 4;
+	uint16_t quote_len = icmp_len - ICMP_LEN - inner->ihl * 4;
+
+	uint16_t old[6];
+	uint16_t new[6];
+	memcpy(old, (uint8_t*)inner + 12, 8);
+	memcpy(old + 4, l4, 4);
+
+	inner->source = endian32(inner_source->addr);
+	inner->destination = endian32(inner_destination->addr);
+	icmperror_set_word(l4, endian16(inner_source->port));
+	icmperror_set_word(l4 + 2, endian16(inner_destination->port));
+	memcpy(new, (uint8_t*)inner + 12, 8);
+	memcpy(new + 4, l4, 4);
+
+	//UDP checksum 0 is none. TCP checksum is quoted only with longer quote.
+	uint8_t* l4_checksum = NULL;
+	if(inner->protocol == IP_PROTOCOL_UDP && icmperror_word(l4 + 6))
+		l4_checksum = l4 + 6;
+	else if(inner->protocol == IP_PROTOCOL_TCP && quote_len >= 18)
+		l4_checksum = l4 + 16;
+
+	if(l4_checksum) {
+		uint32_t sum = (uint16_t)~icmperror_word(l4_checksum);
+		for(int i = 0; i < 6; i++)
+			sum = lb_checksum_adjust(sum, old[i], new[i]);
+		icmperror_set_word(l4_checksum, lb_checksum_fold(sum));
+	}
+
+	inner->checksum = 0;
+	inner->checksum = endian16(checksum(inner, inner->ihl * 4));
+
+	icmp->checksum = 0;
+	icmp->checksum = endian16(checksum(icmp, icmp_len));
+
+	ether->smac = endian48(ni->mac);
+	ether->dmac = endian48(arp_get_mac(ni, destination, source));
+	ip->source = endian32(source);
+	ip->destination = endian32(destination);
+	ip->checksum = 0;
+	ip->checksum = endian16(checksum(ip, ip->ihl * 4));
+
+	neighbor_output(ni, destination, source, vlan, packet);
+}
+
+//Error about a packet sent to server. Client gets it about the packet it sent to service.
+static bool icmperror_to_client(Session* session, Packet* packet) {
+	Endpoint* public_endpoint = session->public_endpoint;
+	icmperror_translate(packet, public_endpoint->ni, session->client_endpoint.vlan, public_endpoint->addr, session->client_endpoint.addr,
+			&session->client_endpoint, public_endpoint);
+
+	return true;
+}
+
+//Error about a packet sent to client. Server gets it about the packet it sent.
+static bool icmperror_to_server(Session* session, Packet* packet) {
+	Service* service = service_get(session->public_endpoint);
+	if(!service || !service->private_endpoints)
+		return false;
+
+	Endpoint* server_endpoint = session->server_endpoint;
+	Endpoint* private_endpoint = map_get(service->private_endpoints, server_endpoint->ni);
+	if(!private_endpoint)
+		return false;
+
+	icmperror_translate(packet, server_endpoint->ni, server_endpoint->vlan, private_endpoint->addr, server_endpoint->addr,
+			server_endpoint, &session->private_endpoint);
+
+	return true;
+}
+
+//ICMP error quoting a header of NAT or DNAT session goes to the other side of the session
+bool icmperror_process(Packet* packet, uint16_t vlan) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+		return false;
+
+	IP* ip = (IP*)ether->payload;
+	if(ip->protocol != IP_PROTOCOL_ICMP)
+		return false;
+
+	ICMP* icmp = (ICMP*)ip->body;
+	switch(icmp->type) {
+		case ICMP_TYPE_DESTINATION_UNREACHABLE:
+		case ICMP_TYPE_SOURCE_QUENCH:
+		case ICMP_TYPE_TIME_EXCEEDED:
+		case ICMP_TYPE_PARAMETER_PROBLEM:
+			break;
+		default:
+			return false;
+	}
+
+	uint16_t icmp_len = endian16(ip->length) - ip->ihl * 4;
+	if(icmp_len < ICMP_LEN + IP_LEN + ICMP_ERROR_QUOTE)
+		return false;
+
+	IP* inner = (IP*)(icmp->body + 4);
+	if(inner->protocol != IP_PROTOCOL_TCP && inner->protocol != IP_PROTOCOL_UDP)
+		return false;
+
+	if(icmp_len < ICMP_LEN + inner->ihl * 4 + ICMP_ERROR_QUOTE)
+		return false;
+
+	uint8_t* l4 = (uint8_t*)inner + inner->ihl * 4;
+	Endpoint inner_source = {
+		.ni = packet->ni,
+		.protocol = inner->protocol,
+		.vlan = vlan,
+		.addr = endian32(inner->source),
+		.port = endian16(icmperror_word(l4)),
+	};
+	Endpoint inner_destination = {
+		.ni = packet->ni,
+		.protocol = inner->protocol,
+		.vlan = vlan,
+		.addr = endian32(inner->destination),
+		.port = endian16(icmperror_word(l4 + 2)),
+	};
+
+	Session* session = server_get_session(&inner_source);
+	if(session && session->server_endpoint->addr == inner_destination.addr && session->server_endpoint->port == inner_destination.port)
+		return icmperror_to_client(session, packet);
+
+	session = service_get_session(&inner_destination);
+	if(session && session->public_endpoint->addr == inner_source.addr && session->public_endpoint->port == inner_source.port)
+		return icmperror_to_server(session, packet);
+
+	return false;
+}
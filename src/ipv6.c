@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/map.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+#include <net/udp.h>
+
+#include "ipv6.h"
+#include "service.h"
+#include "server.h"
+#include "schedule.h"
+#include "pool.h"
+#include "maglev.h"
+#include "tunnel.h"
+#include "vlan.h"
+#include "neighbor.h"
+#include "drop.h"
+#include "shaper.h"
+
+static inline uint32_t ipv6_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline uint64_t ipv6_mix(uint64_t hash, uint64_t value) {
+	hash = (hash ^ value) * 0x9e3779b97f4a7c15;
+
+	return hash ^ (hash >> 29);
+}
+
+static uint64_t ipv6_hash_addr(uint64_t hash, uint8_t* addr) {
+	uint64_t words[2];
+	memcpy(words, addr, 16);
+
+	return ipv6_mix(ipv6_mix(hash, words[0]), words[1]);
+}
+
+static inline uint64_t ipv6_service_key(uint8_t* addr, uint8_t protocol, uint16_t port) {
+	return ipv6_mix(ipv6_hash_addr(0, addr), (uint64_t)protocol << 16 | port);
+}
+
+//Accepts full and :: compressed form
+bool ipv6_parse(char* str, uint8_t* addr) {
+	uint16_t words[8];
+	int count = 0;
+	int gap = -1;
+	char* p = str;
+
+	if(p[0] == ':' && p[1] == ':') {
+		gap = 0;
+		p += 2;
+	}
+
+	while(*p) {
+		if(count == 8)
+			return false;
+
+		char* next;
+		unsigned long word = strtoul(p, &next, 16);
+		if(next == p || next - p > 4 || word > 0xffff)
+			return false;
+		words[count++] = word;
+
+		p = next;
+		if(!*p)
+			break;
+		if(*p++ != ':')
+			return false;
+
+		if(*p == ':') {
+			if(gap >= 0)
+				return false;
+			gap = count;
+			p++;
+		} else if(!*p)
+			return false;
+	}
+
+	if(gap < 0 && count != 8)
+		return false;
+
+	bzero(addr, 16);
+	int tail = gap < 0 ? 0 : count - gap;
+	int head = count - tail;
+	for(int i = 0; i < head; i++) {
+		addr[i * 2] = words[i] >> 8;
+		addr[i * 2 + 1] = words[i];
+	}
+	for(int i = 0; i < tail; i++) {
+		addr[16 - tail * 2 + i * 2] = words[head + i] >> 8;
+		addr[16 - tail * 2 + i * 2 + 1] = words[head + i];
+	}
+
+	return true;
+}
+
+bool ipv6_create(Service* service, uint8_t* addr) {
+	NetworkInterface* ni = service->endpoint.ni;
+	Map* services = ni_config_get(ni, SERVICES6);
+	if(!services) {
+		services = map_create(16, NULL, NULL, ni->pool);
+		if(!services)
+			return false;
+		if(!ni_config_put(ni, SERVICES6, services)) {
+			map_destroy(services);
+			return false;
+		}
+	}
+
+	ipv6_destroy(service);
+
+	Service6* service6 = malloc(sizeof(Service6));
+	if(!service6) {
+		printf("Can'nt allocate IPv6 service\n");
+		return false;
+	}
+	bzero(service6, sizeof(Service6));
+	memcpy(service6->addr, addr, 16);
+	service6->key = ipv6_service_key(addr, service->endpoint.protocol, service->endpoint.port);
+
+	if(!map_put(services, (void*)service6->key, service)) {
+		free(service6);
+		return false;
+	}
+	service->ipv6 = service6;
+
+	return true;
+}
+
+void ipv6_destroy(Service* service) {
+	Service6* service6 = service->ipv6;
+	if(!service6)
+		return;
+
+	Map* services = ni_config_get(service->endpoint.ni, SERVICES6);
+	if(services && map_get(services, (void*)service6->key) == service)
+		map_remove(services, (void*)service6->key);
+
+	free(service6);
+	service->ipv6 = NULL;
+}
+
+void ipv6_remove_server(Service* service, Server* server) {
+	Service6* service6 = service->ipv6;
+	if(!service6)
+		return;
+
+	for(uint32_t i = 0; i < IPV6_FLOW_SIZE; i++) {
+		if(service6->flows[i].server == server) {
+			service6->flows[i].server = NULL;
+			service6->count--;
+		}
+	}
+}
+
+static Service* ipv6_get_service(NetworkInterface* ni, IPv6* ip6, uint8_t protocol, uint16_t port) {
+	Map* services = ni_config_get(ni, SERVICES6);
+	if(!services)
+		return NULL;
+
+	Service* service = map_get(services, (void*)ipv6_service_key(ip6->destination, protocol, port));
+	if(!service || !service->ipv6)
+		return NULL;
+
+	if(memcmp(service->ipv6->addr, ip6->destination, 16) || service->endpoint.protocol != protocol || service->endpoint.port != port)
+		return NULL;
+
+	return service;
+}
+
+static inline bool ipv6_flow_match(Flow6* flow, uint64_t hash, IPv6* ip6, uint16_t source_port, uint16_t destination_port) {
+	return flow->server && flow->hash == hash && flow->source_port == source_port && flow->destination_port == destination_port &&
+		!memcmp(flow->source, ip6->source, 16) && !memcmp(flow->destination, ip6->destination, 16);
+}
+
+/*
+ * Existing flow keeps its server while it is in rotation. New flow is scheduled.
+ * Live flows are never evicted. New flow finding probe window full is placed by consistent hash,
+ * and so is any later packet without a slot, even if a slot has freed up since.
+ * is_new: TCP SYN, or any UDP packet.
+ */
+static Server* ipv6_get_server(Service* service, IPv6* ip6, uint16_t source_port, uint16_t destination_port, bool is_new) {
+	Service6* service6 = service->ipv6;
+	uint64_t hash = ipv6_mix(ipv6_hash_addr(ipv6_hash_addr(0, ip6->source), ip6->destination),
+			(uint64_t)ip6->next_header << 32 | (uint64_t)source_port << 16 | destination_port);
+	uint32_t now = ipv6_now();
+	uint32_t timeout = service->timeout / 1000;
+	uint32_t index = hash & (IPV6_FLOW_SIZE - 1);
+	Flow6* victim = NULL;
+	bool is_free = false;	//victim is empty, expired or stale slot of this flow
+	for(int i = 0; i < IPV6_FLOW_PROBE; i++) {
+		Flow6* flow = &service6->flows[(index + i) & (IPV6_FLOW_SIZE - 1)];
+		bool expired = now - flow->time > timeout;
+		if(ipv6_flow_match(flow, hash, ip6, source_port, destination_port)) {
+			//Removing server keeps its flows
+			uint8_t state = flow->server->state;
+			if(!expired && (state == SERVER_STATE_ACTIVE || state == SERVER_STATE_DEACTIVE)) {
+				flow->time = now;
+				return flow->server;
+			}
+
+			victim = flow;
+			is_free = true;
+			break;
+		}
+
+		if(is_free)
+			continue;
+
+		if(!flow->server || expired) {
+			victim = flow;
+			is_free = true;
+		}
+	}
+
+	if(service->state != SERVICE_STATE_ACTIVE)
+		return NULL;
+
+	if(!is_free || !is_new) {
+		List* servers = service->pool ? service->pool->active_servers : service->active_servers;
+
+		return maglev_get(service->maglev, servers, hash, is_new);
+	}
+
+	if(!schedule_set_priority(service))
+		return NULL;
+
+	//Schedulers see IPv4 endpoint. Client address is folded.
+	uint32_t words[4];
+	memcpy(words, ip6->source, 16);
+	Endpoint client_endpoint = {
+		.ni = service->endpoint.ni,
+		.protocol = ip6->next_header,
+		.addr = endian32(words[0] ^ words[1] ^ words[2] ^ words[3]),
+		.port = source_port,
+	};
+	Server* server = service->next(service, &client_endpoint);
+	if(!server)
+		return NULL;
+
+	if(!victim->server)
+		service6->count++;
+	victim->hash = hash;
+	memcpy(victim->source, ip6->source, 16);
+	memcpy(victim->destination, ip6->destination, 16);
+	victim->source_port = source_port;
+	victim->destination_port = destination_port;
+	victim->protocol = ip6->next_header;
+	victim->time = now;
+	victim->server = server;
+
+	return server;
+}
+
+//IPv6 service traffic. DR rewrites MAC, tunnel mode encapsulates in IPv4.
+bool ipv6_process(Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IPv6* ip6 = (IPv6*)ether->payload;
+	if(packet->end - packet->start < ETHER_LEN + IPV6_LEN + UDP_LEN)
+		return false;
+
+	uint16_t source_port;
+	uint16_t destination_port;
+	bool is_new = true;
+	switch(ip6->next_header) {
+		case IP_PROTOCOL_TCP:
+			;
+			TCP* tcp = (TCP*)ip6->body;
+			source_port = endian16(tcp->source);
+			destination_port = endian16(tcp->destination);
+			is_new = tcp->syn && !tcp->ack;
+			break;
+		case IP_PROTOCOL_UDP:
+			;
+			UDP* udp = (UDP*)ip6->body;
+			source_port = endian16(udp->source);
+			destination_port = endian16(udp->destination);
+			break;
+		default:
+			return false;
+	}
+
+	Service* service = ipv6_get_service(packet->ni, ip6, ip6->next_header, destination_port);
+	if(!service)
+		return false;
+
+	Server* server = ipv6_get_server(service, ip6, source_port, destination_port, is_new);
+	if(!server)
+		return false;
+
+	Endpoint* private_endpoint = map_get(service->private_endpoints, server->endpoint.ni);
+	if(!private_endpoint)
+		return false;
+
+	if(!shaper_pass(service->shaper, packet) || !shaper_pass(server->shaper, packet)) {
+		drop_packet(packet, DROP_SHAPED);
+		return true;
+	}
+
+	switch(server->mode) {
+		case MODE_DR:
+			//Server is dual stack on the same segment
+			ether->smac = endian48(server->endpoint.ni->mac);
+			ether->dmac = endian48(arp_get_mac(server->endpoint.ni, server->endpoint.addr, private_endpoint->addr));
+			break;
+		case MODE_TUNNEL:
+			if(!tunnel_encap(server->tunnel, private_endpoint->addr, packet)) {
+				drop_packet(packet, DROP_HEADROOM);
+				return true;
+			}
+			break;
+		default:
+			return false;
+	}
+
+	neighbor_output(server->endpoint.ni, server->endpoint.addr, private_endpoint->addr, server->endpoint.vlan, packet);
+
+	return true;
+}
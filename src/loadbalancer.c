@@ -14,6 +14,22 @@
 #include "service.h"
 #include "server.h"
 #include "session.h"
+#include "health.h"
+#include "synproxy.h"
+#include "dr.h"
+#include "ops.h"
+#include "frag.h"
+#include "icmperror.h"
+#include "tunnel.h"
+#include "ipv6.h"
+#include "vlan.h"
+#include "neighbor.h"
+#include "drop.h"
+#include "tx.h"
+#include "shaper.h"
+#include "sync.h"
+#include "cluster.h"
+#include "top.h"
 
 extern void* __gmalloc_pool;
 int lb_ginit() {
@@ -21,24 +37,51 @@ int lb_ginit() {
 	if(count < 2)
 		return -1;
 
+	synproxy_init();
+
 	return 0;
 }
 
 int lb_init() {
 	event_init();
+	if(!top_init())
+		return -1;
+	if(!neighbor_init())
+		return -1;
+
 	return 0;
 }
 
 void lb_loop() {
+	tx_flush();
+	sync_loop();
 	event_loop();
 }
 
+static bool lb_drop(Packet* packet, uint8_t reason) {
+	drop_packet(packet, reason);
+
+	return false;
+}
+
+//Every packet is forwarded, consumed or dropped. false is dropped.
 bool lb_process(Packet* packet) {
-	if(arp_process(packet))
+	uint16_t vlan = vlan_pop(packet);
+
+	if(neighbor_process(packet, vlan))
 		return true;
 	
+	if(icmperror_process(packet, vlan))
+		return true;
+
 	if(icmp_process(packet))
 		return true;
+
+	if(sync_process(packet))
+		return true;
+
+	//Packet redirected by another instance is processed as it came from client
+	uint8_t redirects = cluster_decap(packet);
 	
 	Ether* ether = (Ether*)(packet->buffer + packet->start);
 	if(endian16(ether->type) == ETHER_TYPE_IPv4) {
@@ -49,6 +92,17 @@ bool lb_process(Packet* packet) {
 
 		destination_endpoint.ni = packet->ni;
 		source_endpoint.ni = packet->ni;
+		destination_endpoint.vlan = vlan;
+		source_endpoint.vlan = vlan;
+
+		//Fragment without L4 header
+		if((ip->protocol == IP_PROTOCOL_TCP || ip->protocol == IP_PROTOCOL_UDP) && frag_is_later(ip))
+			return frag_process(packet) || lb_drop(packet, DROP_FRAGMENT);
+
+		FragKey key;
+		bool fragment = frag_is_first(ip);
+		if(fragment)
+			frag_key(&key, ip);
 
 		source_endpoint.addr = endian32(ip->source);
 		destination_endpoint.addr = endian32(ip->destination);
@@ -69,32 +123,98 @@ bool lb_process(Packet* packet) {
 				destination_endpoint.port = endian16(udp->destination);
 				break;
 			default:
-				return false;
+				return lb_drop(packet, DROP_PROTOCOL);
 		}
 
 		//Service
 		Session* session = service_get_session(&source_endpoint);
 		if(!session) {
-			session = service_alloc_session(&destination_endpoint, &source_endpoint);
+			uint16_t length = packet->end - packet->start;
+			if(!fragment && (dr_process(&destination_endpoint, &source_endpoint, packet) ||
+					ops_process(&destination_endpoint, &source_endpoint, packet))) {
+				top_update(&source_endpoint, &destination_endpoint, length);
+				return true;
+			}
+
+			//Session of the flow is on its owner instance
+			if(!fragment && cluster_redirect(&destination_endpoint, &source_endpoint, redirects, packet))
+				return true;
+
+			if(synproxy_process(&destination_endpoint, &source_endpoint, packet)) {
+				top_update(&source_endpoint, &destination_endpoint, length);
+				return true;
+			}
+
+			session = service_alloc_session(&destination_endpoint, &source_endpoint, packet);
+			if(session)
+				sync_session(session, SYNC_CREATE);
+		} else if(session->proxy_state == SYNPROXY_CONNECT) {
+			//Server is not connected yet. Client retransmits, so SYN is sent again.
+			top_update(&source_endpoint, &destination_endpoint, packet->end - packet->start);
+			synproxy_retransmit(session);
+			return lb_drop(packet, DROP_RETRANSMIT);
+		} else if(session->sync_time) {
+			sync_refresh(session);
 		}
 		
 		if(session) {
+			top_update(&source_endpoint, &destination_endpoint, packet->end - packet->start);
+			if(!shaper_pass(session->service_shaper, packet) || !shaper_pass(session->server_shaper, packet))
+				return lb_drop(packet, DROP_SHAPED);
+
 			NetworkInterface* server_ni = session->server_endpoint->ni;
-			session->translate(session, packet);
-			ni_output(server_ni, packet);
+			uint16_t server_vlan = session->server_endpoint->vlan;
+			Tunnel* tunnel = session->tunnel;
+			uint32_t next_hop = session->server_endpoint->addr;
+			uint32_t private_addr = session->private_addr;
+			if(!session->translate(session, packet))
+				return lb_drop(packet, DROP_HEADROOM);
+			if(fragment) {
+				neighbor_resolve(server_ni, next_hop, server_vlan, packet);
+				frag_update(&key, packet, server_ni, tunnel, server_vlan);
+			}
+			neighbor_output(server_ni, next_hop, private_addr, server_vlan, packet);
 			return true;
 		}
 
 		//Server
 		session = server_get_session(&destination_endpoint);
 		if(session) {
+			if(session->proxy_state == SYNPROXY_CONNECT)
+				return synproxy_connected(session, packet);
+
+			if(!shaper_pass(session->service_shaper, packet) || !shaper_pass(session->server_shaper, packet))
+				return lb_drop(packet, DROP_SHAPED);
+			if(session->sync_time)
+				sync_refresh(session);
+
 			NetworkInterface* _ni = session->public_endpoint->ni;
+			uint16_t client_vlan = session->client_endpoint.vlan;
+			uint32_t client_addr = session->client_endpoint.addr;
+			uint32_t public_addr = session->public_endpoint->addr;
 			session->untranslate(session, packet);
-			ni_output(_ni, packet);
+			if(fragment) {
+				neighbor_resolve(_ni, client_addr, client_vlan, packet);
+				frag_update(&key, packet, _ni, NULL, client_vlan);
+			}
+			neighbor_output(_ni, client_addr, public_addr, client_vlan, packet);
 			return true;
 		}
-		return false;
+
+		//One-packet reply
+		if(ops_process_reply(&destination_endpoint, &source_endpoint, packet))
+			return true;
+
+		//Health check reply
+		if(health_process(&destination_endpoint, packet))
+			return true;
+
+		//Rejected and unmatched packets are counted too
+		top_update(&source_endpoint, &destination_endpoint, packet->end - packet->start);
+		return lb_drop(packet, service_get(&destination_endpoint) ? DROP_REJECT : DROP_NO_SERVICE);
+	} else if(endian16(ether->type) == ETHER_TYPE_IPv6) {
+		return ipv6_process(packet) || lb_drop(packet, DROP_NO_SERVICE);
 	}
 
-	return false;
+	return lb_drop(packet, DROP_PROTOCOL);
 }
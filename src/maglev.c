@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/list.h>
+#include <util/map.h>
+
+#include "maglev.h"
+#include "server.h"
+
+static inline uint64_t maglev_mix(uint64_t key, uint64_t seed) {
+	uint64_t hash = (key ^ seed) * 0x9e3779b97f4a7c15;
+
+	return hash ^ (hash >> 31);
+}
+
+//Each key fills its preferred slots in turn until the table is full. Key takes as many turns as its weight. NULL is equal.
+void maglev_populate(uint64_t* keys, uint8_t* weights, uint32_t count, uint32_t size, uint16_t* lookup) {
+	if(!count)
+		return;
+
+	uint32_t* next = malloc(sizeof(uint32_t) * count);
+	if(!next)
+		return;
+	bzero(next, sizeof(uint32_t) * count);
+
+	for(uint32_t i = 0; i < size; i++)
+		lookup[i] = UINT16_MAX;
+
+	uint32_t filled = 0;
+	while(1) {
+		for(uint32_t i = 0; i < count; i++) {
+			uint64_t offset = maglev_mix(keys[i], 0x5bd1e995) % size;
+			uint64_t skip = maglev_mix(keys[i], 0x27d4eb2f) % (size - 1) + 1;
+			uint8_t turns = weights && weights[i] ? weights[i] : 1;
+			for(uint8_t j = 0; j < turns; j++) {
+				uint32_t slot;
+				do {
+					slot = (offset + next[i] * skip) % size;
+					next[i]++;
+				} while(lookup[slot] != UINT16_MAX);
+
+				lookup[slot] = i;
+				if(++filled == size) {
+					free(next);
+					return;
+				}
+			}
+		}
+	}
+}
+
+static void maglev_table_destroy(MaglevTable* table) {
+	if(table->servers)
+		free(table->servers);
+	free(table);
+}
+
+//Only the highest tier takes part. Slots are shared by weight.
+static MaglevTable* maglev_table_create(List* servers) {
+	MaglevTable* table = malloc(sizeof(MaglevTable));
+	if(!table)
+		return NULL;
+	bzero(table, sizeof(MaglevTable));
+
+	uint32_t count = 0;
+	uint32_t size = servers ? list_size(servers) : 0;
+	if(size) {
+		table->servers = malloc(sizeof(Server*) * size);
+		uint64_t* keys = malloc(sizeof(uint64_t) * size);
+		uint8_t* weights = malloc(size);
+		if(!table->servers || !keys || !weights) {
+			if(keys)
+				free(keys);
+			if(weights)
+				free(weights);
+			maglev_table_destroy(table);
+			return NULL;
+		}
+
+		uint8_t priority = UINT8_MAX;
+		ListIterator iter;
+		list_iterator_init(&iter, servers);
+		while(list_iterator_has_next(&iter)) {
+			Server* server = list_iterator_next(&iter);
+			if(server->priority < priority)
+				priority = server->priority;
+		}
+
+		list_iterator_init(&iter, servers);
+		while(list_iterator_has_next(&iter)) {
+			Server* server = list_iterator_next(&iter);
+			if(server->priority != priority)
+				continue;
+
+			table->servers[count] = server;
+			keys[count] = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
+			weights[count] = server->weight;
+			count++;
+		}
+
+		maglev_populate(keys, weights, count, MAGLEV_SIZE, table->lookup);
+		free(keys);
+		free(weights);
+	}
+	table->count = count;
+
+	return table;
+}
+
+static bool maglev_contains(MaglevTable* table, Server* server) {
+	for(uint32_t i = 0; i < table->count; i++) {
+		if(table->servers[i] == server)
+			return true;
+	}
+
+	return false;
+}
+
+static void maglev_transition_end(Maglev* maglev) {
+	if(maglev->previous) {
+		maglev_table_destroy(maglev->previous);
+		maglev->previous = NULL;
+	}
+
+	bzero(maglev->flows, sizeof(maglev->flows));
+}
+
+//Previous table and flows must not keep servers that left rotation
+static bool maglev_update(Maglev* maglev, List* servers) {
+	MaglevTable* table = maglev_table_create(servers);
+	if(!table)
+		return false;
+
+	maglev_transition_end(maglev);
+	maglev->previous = maglev->current;
+	maglev->current = table;
+	maglev->generation = server_get_generation();
+
+	if(maglev->previous) {
+		for(uint32_t i = 0; i < maglev->previous->count; i++) {
+			if(!maglev_contains(table, maglev->previous->servers[i]))
+				maglev->previous->servers[i] = NULL;
+		}
+
+		maglev->transition_end = timer_us() + MAGLEV_TRANSITION;
+	}
+
+	return true;
+}
+
+Maglev* maglev_create() {
+	Maglev* maglev = malloc(sizeof(Maglev));
+	if(!maglev)
+		return NULL;
+	bzero(maglev, sizeof(Maglev));
+
+	return maglev;
+}
+
+void maglev_destroy(Maglev* maglev) {
+	maglev_transition_end(maglev);
+	if(maglev->current)
+		maglev_table_destroy(maglev->current);
+	free(maglev);
+}
+
+static inline Server* maglev_lookup(MaglevTable* table, uint64_t hash) {
+	if(!table->count)
+		return NULL;
+
+	return table->servers[table->lookup[hash % MAGLEV_SIZE]];
+}
+
+static inline uint32_t maglev_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline uint32_t maglev_flow_index(uint64_t hash) {
+	return (uint32_t)(hash >> 32) & (MAGLEV_FLOWS - 1);
+}
+
+static Server* maglev_flow_get(Maglev* maglev, uint64_t hash, uint32_t now) {
+	uint32_t index = maglev_flow_index(hash);
+	for(int i = 0; i < MAGLEV_FLOW_PROBE; i++) {
+		MaglevFlow* flow = &maglev->flows[(index + i) & (MAGLEV_FLOWS - 1)];
+		if(flow->server && flow->hash == hash) {
+			flow->time = now;
+			return flow->server;
+		}
+	}
+
+	return NULL;
+}
+
+//Reuses an empty or idle slot, otherwise the oldest in probe window. Evicted flow falls back to the tables.
+static void maglev_flow_put(Maglev* maglev, uint64_t hash, Server* server, uint32_t now) {
+	uint32_t index = maglev_flow_index(hash);
+	MaglevFlow* victim = NULL;
+	for(int i = 0; i < MAGLEV_FLOW_PROBE; i++) {
+		MaglevFlow* flow = &maglev->flows[(index + i) & (MAGLEV_FLOWS - 1)];
+		if(!flow->server || now - flow->time > MAGLEV_FLOW_TIMEOUT) {
+			victim = flow;
+			break;
+		}
+
+		if(!victim || now - flow->time > now - victim->time)
+			victim = flow;
+	}
+
+	victim->hash = hash;
+	victim->time = now;
+	victim->server = server;
+}
+
+//is_new: first packet of a flow(TCP SYN). Other packets follow previous table while membership is changing.
+Server* maglev_get(Maglev* maglev, List* servers, uint64_t hash, bool is_new) {
+	if(!maglev->current || maglev->generation != server_get_generation()) {
+		if(!maglev_update(maglev, servers))
+			return NULL;
+	}
+
+	if(!maglev->previous)
+		return maglev_lookup(maglev->current, hash);
+
+	if(timer_us() > maglev->transition_end) {
+		maglev_transition_end(maglev);
+		return maglev_lookup(maglev->current, hash);
+	}
+
+	uint32_t now = maglev_now();
+	Server* server = maglev_flow_get(maglev, hash, now);
+	if(server)
+		return server;
+
+	if(!is_new)
+		server = maglev_lookup(maglev->previous, hash);
+	if(!server)
+		server = maglev_lookup(maglev->current, hash);
+
+	if(server)
+		maglev_flow_put(maglev, hash, server, now);
+
+	return server;
+}
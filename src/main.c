@@ -11,6 +11,16 @@
 #include "service.h"
 #include "server.h"
 #include "schedule.h"
+#include "pool.h"
+#include "health.h"
+#include "outlier.h"
+#include "top.h"
+#include "drop.h"
+#include "shaper.h"
+#include "sync.h"
+#include "cluster.h"
+#include "tunnel.h"
+#include "ipv6.h"
 #include "loadbalancer.h"
 
 static bool is_continue;
@@ -57,7 +67,34 @@ static int cmd_exit(int argc, char** argv, void(*callback)(char* result, int exi
 	return 0;
 }
 
+//"-vlan id" applies to endpoints of the command. It is taken out of arguments.
+static bool vlan_option(int* argc, char** argv, uint16_t* vlan) {
+	*vlan = 0;
+	for(int i = 2; i < *argc; i++) {
+		if(strcmp(argv[i], "-vlan"))
+			continue;
+
+		if(i + 1 >= *argc || !is_uint16(argv[i + 1]))
+			return false;
+		*vlan = parse_uint16(argv[i + 1]);
+		if(*vlan > 4094)
+			return false;
+
+		for(int j = i; j + 2 < *argc; j++)
+			argv[j] = argv[j + 2];
+		*argc -= 2;
+
+		return true;
+	}
+
+	return true;
+}
+
 static int cmd_service(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	uint16_t vlan;
+	if(!vlan_option(&argc, argv, &vlan))
+		return -1;
+
 	if(!strcmp(argv[1], "add")) {
 		int i = 2;
 		Service* service = NULL;
@@ -69,6 +106,7 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 				service_endpoint.protocol = IP_PROTOCOL_TCP;
 				service_endpoint.addr = str_to_addr(argv[i]);
 				service_endpoint.port = str_to_port(argv[i]);
+				service_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -90,6 +128,7 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 				service_endpoint.protocol = IP_PROTOCOL_UDP;
 				service_endpoint.addr = str_to_addr(argv[i]);
 				service_endpoint.port = str_to_port(argv[i]);
+				service_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -119,16 +158,182 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 					schedule = SCHEDULE_SOURCE_IP_HASH;
 				else if(!strcmp(argv[i], "w"))
 					schedule = SCHEDULE_WEIGHTED_ROUND_ROBIN;
+				else if(!strcmp(argv[i], "t"))
+					schedule = SCHEDULE_MIN_REQUEST_TIME;
 				else
 					return i;
 
 				service_set_schedule(service, schedule);
+				continue;
+			} else if(!strcmp(argv[i], "-persist") && !!service) {
+				uint64_t timeout;
+				uint8_t prefix;
+				uint32_t size;
+
+				i++;
+				if(is_uint64(argv[i]))
+					timeout = parse_uint64(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint8(argv[i]))
+					prefix = parse_uint8(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint32(argv[i]))
+					size = parse_uint32(argv[i]);
+				else
+					return i;
+
+				if(!service_set_persist(service, timeout, prefix, size))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-rl") && !!service) {
+				uint32_t rate;
+				uint32_t burst;
+				uint32_t max_sessions;
+				uint32_t size = 0;
+
+				i++;
+				if(is_uint32(argv[i]))
+					rate = parse_uint32(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint32(argv[i]))
+					burst = parse_uint32(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint32(argv[i]))
+					max_sessions = parse_uint32(argv[i]);
+				else
+					return i;
+				if(i + 1 < argc && is_uint32(argv[i + 1]))
+					size = parse_uint32(argv[++i]);
+
+				if(!service_set_ratelimit(service, rate, burst, max_sessions, size))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-prefix") && !!service) {
+				i++;
+				if(is_uint8(argv[i])) {
+					if(!service_set_range(service, parse_uint8(argv[i]), service->port_end))
+						return i;
+				} else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-ports") && !!service) {
+				i++;
+				if(is_uint16(argv[i])) {
+					if(!service_set_range(service, service->prefix, parse_uint16(argv[i])))
+						return i;
+				} else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-shape") && !!service) {
+				uint64_t pps;
+				uint64_t bps;
+				uint8_t action = SHAPER_DROP;
+
+				i++;
+				if(is_uint64(argv[i]))
+					pps = parse_uint64(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					bps = parse_uint64(argv[i]);
+				else
+					return i;
+				if(i + 1 < argc && !strcmp(argv[i + 1], "mark")) {
+					action = SHAPER_MARK;
+					i++;
+				} else if(i + 1 < argc && !strcmp(argv[i + 1], "drop")) {
+					i++;
+				}
+
+				if(!service_set_shaper(service, pps, bps, action))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-stateless") && !!service) {
+				if(!service_set_stateless(service, true))
+					return i;
+				continue;
+			} else if(!strcmp(argv[i], "-pickup") && !!service) {
+				if(!service_set_pickup(service, true))
+					return i;
+				continue;
+			} else if(!strcmp(argv[i], "-v6") && !!service) {
+				i++;
+				uint8_t addr[16];
+				if(!argv[i] || !ipv6_parse(argv[i], addr))
+					return i;
+
+				if(!service_set_ipv6(service, addr))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-quic") && !!service) {
+				if(!service_set_quic(service, true))
+					return i;
+				continue;
+			} else if(!strcmp(argv[i], "-ops") && !!service) {
+				uint32_t size = 0;
+				bool match_id = false;
+
+				if(i + 1 < argc && is_uint32(argv[i + 1]))
+					size = parse_uint32(argv[++i]);
+				if(i + 1 < argc && !strcmp(argv[i + 1], "id")) {
+					match_id = true;
+					i++;
+				}
+
+				if(!service_set_one_packet(service, true, size, match_id))
+					return i;
+				continue;
+			} else if(!strcmp(argv[i], "-synproxy") && !!service) {
+				service_set_syn_proxy(service, true);
+				continue;
+			} else if(!strcmp(argv[i], "-ej") && !!service) {
+				i++;
+				if(is_uint8(argv[i])) {
+					if(!service_set_max_ejection(service, parse_uint8(argv[i])))
+						return i;
+				} else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-max") && !!service) {
+				i++;
+				if(is_uint32(argv[i]))
+					service_set_max_sessions(service, parse_uint32(argv[i]));
+				else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-p") && !!service) {
+				i++;
+				Pool* pool = pool_get(argv[i]);
+				if(!pool)
+					return i;
+
+				if(!service_set_pool(service, pool))
+					return i;
+
 				continue;
 			} else if(!strcmp(argv[i], "-out") && !!service) {
 				i++;
 				Endpoint private_endpoint;
 				private_endpoint.addr = str_to_addr(argv[i]);
 				private_endpoint.port = 0;
+				private_endpoint.vlan = 0;
 				i++;
 				if(is_uint8(argv[i])) {
 					 uint8_t ni_num = parse_uint8(argv[i]);
@@ -164,6 +369,7 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 				service_endpoint.protocol = IP_PROTOCOL_TCP;
 				service_endpoint.addr = str_to_addr(argv[i]);
 				service_endpoint.port = str_to_port(argv[i]);
+				service_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -185,6 +391,7 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 				service_endpoint.protocol = IP_PROTOCOL_UDP;
 				service_endpoint.addr = str_to_addr(argv[i]);
 				service_endpoint.port = str_to_port(argv[i]);
+				service_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -230,10 +437,24 @@ static int cmd_service(int argc, char** argv, void(*callback)(char* result, int
 }
 
 static int cmd_server(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	uint16_t vlan;
+	if(!vlan_option(&argc, argv, &vlan))
+		return -1;
+
 	if(!strcmp(argv[1], "add")) {
 		int i = 2;
 		Server* server = NULL;
 
+		//Pool must be known before server is bound
+		Pool* pool = NULL;
+		for(int j = 2; j < argc - 1; j++) {
+			if(!strcmp(argv[j], "-p")) {
+				pool = pool_get(argv[j + 1]);
+				if(!pool)
+					return j + 1;
+			}
+		}
+
 		for(;i < argc; i++) {
 			if(!strcmp(argv[i], "-t") && !server) {
 				i++;
@@ -241,6 +462,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				server_endpoint.protocol = IP_PROTOCOL_TCP;
 				server_endpoint.addr = str_to_addr(argv[i]);
 				server_endpoint.port = str_to_port(argv[i]);
+				server_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -251,7 +473,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				} else
 					return i;
 
-				server = server_alloc(&server_endpoint);
+				server = server_alloc(&server_endpoint, pool);
 				if(!server)
 					return i;
 
@@ -262,6 +484,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				server_endpoint.protocol = IP_PROTOCOL_UDP;
 				server_endpoint.addr = str_to_addr(argv[i]);
 				server_endpoint.port = str_to_port(argv[i]);
+				server_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -273,7 +496,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 					return i;
 
 
-				server = server_alloc(&server_endpoint);
+				server = server_alloc(&server_endpoint, pool);
 				if(!server)
 					return i;
 
@@ -281,20 +504,180 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 			} else if(!strcmp(argv[i], "-m") && !!server) {
 				i++;
 				uint8_t mode;
+				uint8_t tunnel = 0;
 				if(!strcmp(argv[i], "nat")) {
 					mode = MODE_NAT;
-					continue;
 				} else if(!strcmp(argv[i], "dnat")) {
 					mode = MODE_DNAT;
-					continue;
 				} else if(!strcmp(argv[i], "dr")) {
 					mode = MODE_DR;
-					continue;
+				} else if(!strcmp(argv[i], "ipip")) {
+					mode = MODE_TUNNEL;
+					tunnel = TUNNEL_IPIP;
+				} else if(!strcmp(argv[i], "gue")) {
+					mode = MODE_TUNNEL;
+					tunnel = TUNNEL_GUE;
 				} else
 					return i;
 
+				if(tunnel && !server_set_tunnel(server, tunnel, TUNNEL_GUE_PORT))
+					return i;
+
 				if(!server_set_mode(server, mode))
 					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-p") && !!server) {
+				i++;
+				continue;
+			} else if(!strcmp(argv[i], "-w") && !!server) {
+				i++;
+				if(is_uint8(argv[i])) {
+					if(!server_set_weight(server, parse_uint8(argv[i])))
+						return i;
+				} else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-pr") && !!server) {
+				i++;
+				if(is_uint8(argv[i]))
+					server_set_priority(server, parse_uint8(argv[i]));
+				else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-max") && !!server) {
+				i++;
+				if(is_uint32(argv[i]))
+					server_set_max_sessions(server, parse_uint32(argv[i]));
+				else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-hc") && !!server) {
+				uint8_t type;
+				uint64_t interval;
+				uint8_t rise;
+				uint8_t fall;
+				uint64_t jitter;
+
+				i++;
+				if(!strcmp(argv[i], "tcp"))
+					type = HEALTH_TCP;
+				else if(!strcmp(argv[i], "udp"))
+					type = HEALTH_UDP;
+				else if(!strcmp(argv[i], "http"))
+					type = HEALTH_HTTP;
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					interval = parse_uint64(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint8(argv[i]))
+					rise = parse_uint8(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint8(argv[i]))
+					fall = parse_uint8(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					jitter = parse_uint64(argv[i]);
+				else
+					return i;
+
+				if(!health_start(server, type, interval, rise, fall, jitter))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-hp") && !!server) {
+				i++;
+				if(!health_set_path(server, argv[i]))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-od") && !!server) {
+				uint8_t error_percent;
+				uint32_t min_requests;
+				uint64_t window;
+				uint64_t ejection_time;
+				uint64_t deadline = 0;
+
+				i++;
+				if(is_uint8(argv[i]))
+					error_percent = parse_uint8(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint32(argv[i]))
+					min_requests = parse_uint32(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					window = parse_uint64(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					ejection_time = parse_uint64(argv[i]);
+				else
+					return i;
+				if(i + 1 < argc && is_uint64(argv[i + 1]))
+					deadline = parse_uint64(argv[++i]);
+
+				if(!outlier_start(server, error_percent, min_requests, window, ejection_time, deadline))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-qid") && !!server) {
+				i++;
+				if(is_uint8(argv[i]))
+					server_set_quic_id(server, parse_uint8(argv[i]));
+				else
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-shape") && !!server) {
+				uint64_t pps;
+				uint64_t bps;
+				uint8_t action = SHAPER_DROP;
+
+				i++;
+				if(is_uint64(argv[i]))
+					pps = parse_uint64(argv[i]);
+				else
+					return i;
+				i++;
+				if(is_uint64(argv[i]))
+					bps = parse_uint64(argv[i]);
+				else
+					return i;
+				if(i + 1 < argc && !strcmp(argv[i + 1], "mark")) {
+					action = SHAPER_MARK;
+					i++;
+				} else if(i + 1 < argc && !strcmp(argv[i + 1], "drop")) {
+					i++;
+				}
+
+				if(!server_set_shaper(server, pps, bps, action))
+					return i;
+
+				continue;
+			} else if(!strcmp(argv[i], "-ss") && !!server) {
+				i++;
+				if(is_uint64(argv[i]))
+					server_set_slow_start(server, parse_uint64(argv[i]));
+				else
+					return i;
+
+				continue;
 			} else
 				return i;
 		}
@@ -318,6 +701,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				server_endpoint.protocol = IP_PROTOCOL_TCP;
 				server_endpoint.addr = str_to_addr(argv[i]);
 				server_endpoint.port = str_to_port(argv[i]);
+				server_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -328,7 +712,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				} else
 					return i;
 
-				server = server_alloc(&server_endpoint);
+				server = server_get(&server_endpoint);
 				if(!server)
 					return i;
 
@@ -339,6 +723,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				server_endpoint.protocol = IP_PROTOCOL_UDP;
 				server_endpoint.addr = str_to_addr(argv[i]);
 				server_endpoint.port = str_to_port(argv[i]);
+				server_endpoint.vlan = vlan;
 				i++;
 
 				if(is_uint8(argv[i])) {
@@ -349,7 +734,7 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 				} else
 					return i;
 
-				server = server_alloc(&server_endpoint);
+				server = server_get(&server_endpoint);
 				if(!server)
 					return i;
 
@@ -390,6 +775,180 @@ static int cmd_server(int argc, char** argv, void(*callback)(char* result, int e
 	return 0;
 }
 
+static int cmd_pool(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 2)
+		return -1;
+
+	if(!strcmp(argv[1], "add")) {
+		if(argc != 3)
+			return -1;
+
+		if(!pool_alloc(argv[2])) {
+			printf("Can'nt create pool\n");
+			return 2;
+		}
+
+		return 0;
+	} else if(!strcmp(argv[1], "delete")) {
+		if(argc != 3)
+			return -1;
+
+		Pool* pool = pool_get(argv[2]);
+		if(!pool) {
+			printf("Can'nt found pool\n");
+			return 2;
+		}
+
+		if(!pool_free(pool))
+			return 2;
+
+		return 0;
+	} else if(!strcmp(argv[1], "list")) {
+		printf("Loadbalancer Pool List\n");
+		pool_dump();
+
+		return 0;
+	} else
+		return -1;
+
+	return 0;
+}
+
+static int cmd_top(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	uint8_t key = TOP_SOURCE;
+	uint8_t metric = TOP_PACKETS;
+	uint32_t count = 10;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "reset")) {
+			top_reset();
+			return 0;
+		} else if(!strcmp(argv[i], "src")) {
+			key = TOP_SOURCE;
+		} else if(!strcmp(argv[i], "service")) {
+			key = TOP_SERVICE;
+		} else if(!strcmp(argv[i], "packets")) {
+			metric = TOP_PACKETS;
+		} else if(!strcmp(argv[i], "bytes")) {
+			metric = TOP_BYTES;
+		} else if(is_uint32(argv[i])) {
+			count = parse_uint32(argv[i]);
+		} else
+			return i;
+	}
+
+	top_dump(key, metric, count);
+
+	return 0;
+}
+
+static int cmd_drop(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc > 1) {
+		if(!strcmp(argv[1], "reset")) {
+			drop_reset();
+			return 0;
+		} else
+			return 1;
+	}
+
+	drop_dump();
+
+	return 0;
+}
+
+static int cmd_sync(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 2)
+		return -1;
+
+	if(!strcmp(argv[1], "master") || !strcmp(argv[1], "backup")) {
+		uint8_t role = !strcmp(argv[1], "master") ? SYNC_MASTER : SYNC_BACKUP;
+		uint64_t pps = 0;
+		uint64_t bps = 0;
+		if(argc < 5)
+			return -1;
+
+		uint32_t addr = str_to_addr(argv[2]);
+		uint32_t peer = str_to_addr(argv[3]);
+		NetworkInterface* ni = NULL;
+		if(is_uint8(argv[4]))
+			ni = ni_get(parse_uint8(argv[4]));
+		if(!ni)
+			return 4;
+
+		if(argc > 5) {
+			if(!is_uint64(argv[5]))
+				return 5;
+			pps = parse_uint64(argv[5]);
+		}
+		if(argc > 6) {
+			if(!is_uint64(argv[6]))
+				return 6;
+			bps = parse_uint64(argv[6]);
+		}
+
+		if(!sync_start(role, ni, addr, peer, pps, bps)) {
+			printf("Can'nt start synchronization\n");
+			return -1;
+		}
+
+		return 0;
+	} else if(!strcmp(argv[1], "stop")) {
+		sync_stop();
+
+		return 0;
+	} else if(!strcmp(argv[1], "list")) {
+		sync_dump();
+
+		return 0;
+	} else
+		return 1;
+}
+
+static int cmd_cluster(int argc, char** argv, void(*callback)(char* result, int exit_status)) {
+	if(argc < 2)
+		return -1;
+
+	if(!strcmp(argv[1], "start")) {
+		if(argc < 4)
+			return -1;
+
+		uint32_t addr = str_to_addr(argv[2]);
+		NetworkInterface* ni = NULL;
+		if(is_uint8(argv[3]))
+			ni = ni_get(parse_uint8(argv[3]));
+		if(!ni)
+			return 3;
+
+		if(!cluster_start(ni, addr)) {
+			printf("Can'nt start cluster\n");
+			return -1;
+		}
+
+		return 0;
+	} else if(!strcmp(argv[1], "add") || !strcmp(argv[1], "remove")) {
+		if(argc < 3)
+			return -1;
+
+		uint32_t addr = str_to_addr(argv[2]);
+		bool result = !strcmp(argv[1], "add") ? cluster_add(addr) : cluster_remove(addr);
+		if(!result) {
+			printf("Can'nt %s instance\n", argv[1]);
+			return -1;
+		}
+
+		return 0;
+	} else if(!strcmp(argv[1], "stop")) {
+		cluster_stop();
+
+		return 0;
+	} else if(!strcmp(argv[1], "list")) {
+		cluster_dump();
+
+		return 0;
+	} else
+		return 1;
+}
+
 Command commands[] = {
 	{
 		.name = "exit",
@@ -413,6 +972,36 @@ Command commands[] = {
 		.args = "-add ip [rip ip] port [rip port]\n-del ip [rip ip] port [rip port]",
 		.func = cmd_server
 	},
+	{
+		.name = "pool",
+		.desc = "Set server pool",
+		.args = "add [name]\ndelete [name]\nlist",
+		.func = cmd_pool
+	},
+	{
+		.name = "top",
+		.desc = "Heavy hitters of recent traffic",
+		.args = "[src|service] [packets|bytes] [count]\nreset",
+		.func = cmd_top
+	},
+	{
+		.name = "drop",
+		.desc = "Dropped packets by reason",
+		.args = "[reset]",
+		.func = cmd_drop
+	},
+	{
+		.name = "sync",
+		.desc = "Session synchronization with standby",
+		.args = "[master|backup] [addr] [peer addr] [ni] [packets per second] [bits per second]\nstop\nlist",
+		.func = cmd_sync
+	},
+	{
+		.name = "cluster",
+		.desc = "Flow ownership of instances behind ECMP",
+		.args = "start [addr] [ni]\nadd [addr]\nremove [addr]\nstop\nlist",
+		.func = cmd_cluster
+	},
 	{
 		.name = NULL,
 		.desc = NULL,
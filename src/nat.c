@@ -14,6 +14,7 @@
 #include "nat.h"
 #include "endpoint.h"
 #include "session.h"
+#include "synproxy.h"
 #include "service.h"
 
 static bool nat_tcp_translate(Session* session, Packet* packet);
@@ -37,6 +38,7 @@ Session* nat_tcp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endp
 	memcpy(&session->private_endpoint, private_endpoint, sizeof(Endpoint));
 	session->private_endpoint.port = tcp_port_alloc(private_endpoint->ni, private_endpoint->addr);
 
+	session->tunnel = NULL;
 	session->event_id = 0;
 	session_recharge(session);
 	session->fin = false;
@@ -63,6 +65,7 @@ Session* nat_udp_session_alloc(Endpoint* server_endpoint, Endpoint* service_endp
 	memcpy(&session->private_endpoint, private_endpoint, sizeof(Endpoint));
 	session->private_endpoint.port = udp_port_alloc(private_endpoint->ni, private_endpoint->addr);
 
+	session->tunnel = NULL;
 	session->event_id = 0;
 	session_recharge(session);
 	session->fin = false;
@@ -101,6 +104,9 @@ static bool nat_tcp_translate(Session* session, Packet* packet) {
 	ip->destination = endian32(server_endpoint->addr);
 	tcp->source = endian16(private_endpoint->port);
 	tcp->destination = endian16(server_endpoint->port);
+	session_latency_request(session, packet);
+	if(session->proxy_state)
+		synproxy_translate(session, tcp);
 
 	tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 	session_recharge(session);
@@ -126,6 +132,7 @@ static bool nat_udp_translate(Session* session, Packet* packet) {
 	ip->destination = endian32(server_endpoint->addr);
 	udp->source = endian16(private_endpoint->port);
 	udp->destination = endian16(server_endpoint->port);
+	session_latency_request(session, packet);
 
 	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
 
@@ -146,6 +153,9 @@ static bool nat_tcp_untranslate(Session* session, Packet* packet) {
 	ip->destination = endian32(session->client_endpoint.addr);
 	tcp->source = endian16(public_endpoint->port);
 	tcp->destination = endian16(session->client_endpoint.port);
+	session_latency_response(session, packet);
+	if(session->proxy_state)
+		synproxy_untranslate(session, tcp);
 
 	tcp_pack(packet, endian16(ip->length) - ip->ihl * 4 - TCP_LEN);
 	if(tcp->fin) {
@@ -167,6 +177,7 @@ static bool nat_udp_untranslate(Session* session, Packet* packet) {
 	ip->destination = endian32(session->client_endpoint.addr);
 	udp->source = endian16(public_endpoint->port);
 	udp->destination = endian16(session->client_endpoint.port);
+	session_latency_response(session, packet);
 
 	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
 
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <thread.h>
+#include <util/map.h>
+#include <util/event.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+
+#include "neighbor.h"
+#include "service.h"
+#include "server.h"
+#include "vlan.h"
+#include "drop.h"
+#include "tx.h"
+
+static uint32_t refresh_time;
+
+static inline uint32_t neighbor_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline bool neighbor_is_resolved(uint64_t mac) {
+	return mac && mac != 0xffffffffffff;
+}
+
+static inline uint64_t neighbor_key(uint16_t vlan, uint32_t addr) {
+	return (uint64_t)vlan << 32 | addr;
+}
+
+static Neighbor* neighbor_get(NetworkInterface* ni, uint16_t vlan, uint32_t addr) {
+	Map* neighbors = ni_config_get(ni, NEIGHBORS);
+	if(!neighbors)
+		return NULL;
+
+	return map_get(neighbors, (void*)neighbor_key(vlan, addr));
+}
+
+static void neighbor_send(NetworkInterface* ni, uint16_t vlan, Packet* packet) {
+	if(!vlan_push(packet, vlan)) {
+		drop_packet(packet, DROP_HEADROOM);
+		return;
+	}
+
+	tx_output(ni, packet);
+}
+
+static void neighbor_arp_output(NetworkInterface* ni, uint16_t vlan, uint16_t operation, uint64_t dmac, uint32_t destination, uint32_t source) {
+	Packet* packet = ni_alloc(ni, ETHER_LEN + ARP_LEN);
+	if(!packet)
+		return;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(dmac ? dmac : 0xffffffffffff);
+	ether->smac = endian48(ni->mac);
+	ether->type = endian16(ETHER_TYPE_ARP);
+
+	ARP* arp = (ARP*)ether->payload;
+	arp->htype = endian16(1);
+	arp->ptype = endian16(ETHER_TYPE_IPv4);
+	arp->hlen = 6;
+	arp->plen = 4;
+	arp->operation = endian16(operation);
+	arp->sha = endian48(ni->mac);
+	arp->spa = endian32(source);
+	arp->tha = endian48(dmac);
+	arp->tpa = endian32(destination);
+
+	packet->end = packet->start + ETHER_LEN + ARP_LEN;
+	neighbor_send(ni, vlan, packet);
+}
+
+//Untagged request goes through stack. Tagged one carries the tag of its VLAN.
+static void neighbor_request(NetworkInterface* ni, uint16_t vlan, uint32_t destination, uint32_t source) {
+	if(!vlan)
+		arp_request(ni, destination, source);
+	else
+		neighbor_arp_output(ni, vlan, ARP_REQUEST, 0, destination, source);
+}
+
+static inline uint64_t neighbor_get_mac(NetworkInterface* ni, Neighbor* neighbor) {
+	if(!neighbor->vlan)
+		return arp_get_mac(ni, neighbor->addr, neighbor->source);
+
+	return neighbor->mac;
+}
+
+static void neighbor_free(Neighbor* neighbor) {
+	for(int i = 0; i < neighbor->count; i++)
+		drop_packet(neighbor->packets[i], DROP_NEIGHBOR);
+	free(neighbor);
+}
+
+//Send held packets once the MAC is learned, by stack or by ARP of tagged VLAN
+static bool neighbor_flush(NetworkInterface* ni, Neighbor* neighbor) {
+	uint64_t mac = neighbor_get_mac(ni, neighbor);
+	if(!neighbor_is_resolved(mac))
+		return false;
+
+	for(int i = 0; i < neighbor->count; i++) {
+		Ether* ether = (Ether*)(neighbor->packets[i]->buffer + neighbor->packets[i]->start);
+		ether->dmac = endian48(mac);
+		neighbor_send(ni, neighbor->vlans[i], neighbor->packets[i]);
+	}
+	neighbor->count = 0;
+
+	return true;
+}
+
+//Any private address of service on NIC is sender of ARP request toward servers
+static uint32_t neighbor_source(NetworkInterface* ni) {
+	uint16_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			if(!service->private_endpoints)
+				continue;
+
+			Endpoint* private_endpoint = map_get(service->private_endpoints, ni);
+			if(private_endpoint)
+				return private_endpoint->addr;
+		}
+	}
+
+	return 0;
+}
+
+//Request ARP of every server before the entry expires. Reply renews it without a miss on data path.
+static void neighbor_refresh() {
+	uint16_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		NetworkInterface* ni = ni_get(i);
+		Map* servers = ni_config_get(ni, SERVERS);
+		if(!servers || map_is_empty(servers))
+			continue;
+
+		uint32_t source = neighbor_source(ni);
+		if(!source)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			neighbor_request(ni, server->endpoint.vlan, server->endpoint.addr, source);
+		}
+	}
+}
+
+static bool neighbor_tick(void* context) {
+	uint32_t now = neighbor_now();
+	uint16_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		NetworkInterface* ni = ni_get(i);
+		Map* neighbors = ni_config_get(ni, NEIGHBORS);
+		if(!neighbors || map_is_empty(neighbors))
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, neighbors);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Neighbor* neighbor = entry->data;
+			if(neighbor_flush(ni, neighbor)) {
+				if(!neighbor->vlan || now - neighbor->learned > NEIGHBOR_TIMEOUT) {
+					map_iterator_remove(&iter);
+					neighbor_free(neighbor);
+					continue;
+				}
+
+				//Tagged entry is the ARP table of its VLAN. It is renewed before it is forgotten.
+				if(now - neighbor->learned >= NEIGHBOR_REFRESH && now - neighbor->time >= NEIGHBOR_REFRESH) {
+					neighbor_request(ni, neighbor->vlan, neighbor->addr, neighbor->source);
+					neighbor->time = now;
+				}
+				continue;
+			}
+
+			if(now - neighbor->time < NEIGHBOR_RETRY)
+				continue;
+
+			//Next hop is gone. Held packets are dropped.
+			if(++neighbor->retries > NEIGHBOR_RETRIES) {
+				map_iterator_remove(&iter);
+				neighbor_free(neighbor);
+				continue;
+			}
+
+			neighbor_request(ni, neighbor->vlan, neighbor->addr, neighbor->source);
+			neighbor->time = now;
+		}
+	}
+
+	if(now - refresh_time >= NEIGHBOR_REFRESH) {
+		refresh_time = now;
+		neighbor_refresh();
+	}
+
+	return true;
+}
+
+//Only one thread retries and refreshes
+bool neighbor_init() {
+	if(thread_id() != 0)
+		return true;
+
+	refresh_time = neighbor_now();
+
+	return !!event_timer_add(neighbor_tick, NULL, NEIGHBOR_RETRY * 1000, NEIGHBOR_RETRY * 1000);
+}
+
+static Map* neighbor_map(NetworkInterface* ni) {
+	Map* neighbors = ni_config_get(ni, NEIGHBORS);
+	if(neighbors)
+		return neighbors;
+
+	neighbors = map_create(16, NULL, NULL, ni->pool);
+	if(!neighbors)
+		return NULL;
+
+	if(!ni_config_put(ni, NEIGHBORS, neighbors)) {
+		map_destroy(neighbors);
+		return NULL;
+	}
+
+	return neighbors;
+}
+
+/*
+ * Sender of ARP on a tagged VLAN. Only neighbors already looked up or talking to
+ * this loadbalancer are kept, not every host of the VLAN.
+ */
+static void neighbor_learn(NetworkInterface* ni, uint16_t vlan, uint32_t addr, uint32_t source, uint64_t mac, bool is_peer) {
+	Neighbor* neighbor = neighbor_get(ni, vlan, addr);
+	if(!neighbor) {
+		if(!is_peer)
+			return;
+
+		Map* neighbors = neighbor_map(ni);
+		if(!neighbors)
+			return;
+
+		neighbor = malloc(sizeof(Neighbor));
+		if(!neighbor)
+			return;
+		bzero(neighbor, sizeof(Neighbor));
+		neighbor->addr = addr;
+		neighbor->vlan = vlan;
+		neighbor->source = source;
+		neighbor->time = neighbor_now();
+
+		if(!map_put(neighbors, (void*)neighbor_key(vlan, addr), neighbor)) {
+			free(neighbor);
+			return;
+		}
+	}
+
+	neighbor->mac = mac;
+	neighbor->learned = neighbor_now();
+	neighbor->retries = 0;
+	neighbor_flush(ni, neighbor);
+}
+
+//Stack answers untagged ARP only. Request for an address of this NIC is answered with the tag it came with.
+static bool neighbor_tagged_process(Packet* packet, uint16_t vlan) {
+	NetworkInterface* ni = packet->ni;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_ARP)
+		return false;
+
+	if(packet->end - packet->start < ETHER_LEN + ARP_LEN) {
+		drop_packet(packet, DROP_PROTOCOL);
+		return true;
+	}
+
+	ARP* arp = (ARP*)ether->payload;
+	uint32_t sender = endian32(arp->spa);
+	uint32_t target = endian32(arp->tpa);
+	uint64_t mac = endian48(arp->sha);
+	bool is_peer = !!ni_ip_get(ni, target);
+	if(sender && neighbor_is_resolved(mac))
+		neighbor_learn(ni, vlan, sender, target, mac, is_peer);
+
+	if(is_peer && endian16(arp->operation) == ARP_REQUEST && sender)
+		neighbor_arp_output(ni, vlan, ARP_REPLY, mac, sender, target);
+
+	ni_free(packet);
+
+	return true;
+}
+
+//ARP reply releases packets held for its sender
+bool neighbor_process(Packet* packet, uint16_t vlan) {
+	if(vlan)
+		return neighbor_tagged_process(packet, vlan);
+
+	NetworkInterface* ni = packet->ni;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	uint32_t sender = 0;
+	if(endian16(ether->type) == ETHER_TYPE_ARP) {
+		ARP* arp = (ARP*)ether->payload;
+		sender = endian32(arp->spa);
+	}
+
+	if(!arp_process(packet))
+		return false;
+
+	Map* neighbors = sender ? ni_config_get(ni, NEIGHBORS) : NULL;
+	if(!neighbors)
+		return true;
+
+	Neighbor* neighbor = map_get(neighbors, (void*)(uintptr_t)sender);
+	if(neighbor && neighbor_flush(ni, neighbor)) {
+		map_remove(neighbors, (void*)(uintptr_t)sender);
+		neighbor_free(neighbor);
+	}
+
+	return true;
+}
+
+//Translation fills destination MAC from stack ARP table. It is replaced by the one of VLAN on tagged side.
+void neighbor_resolve(NetworkInterface* ni, uint32_t destination, uint16_t vlan, Packet* packet) {
+	if(!vlan)
+		return;
+
+	Neighbor* neighbor = neighbor_get(ni, vlan, destination);
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(neighbor && neighbor->mac ? neighbor->mac : 0xffffffffffff);
+}
+
+/*
+ * Destination MAC is filled by translation. Unresolved one is broadcast,
+ * then the packet waits for ARP reply instead of being sent to it.
+ * Stack has sent ARP request already on the miss of untagged next hop.
+ */
+bool neighbor_output(NetworkInterface* ni, uint32_t destination, uint32_t source, uint16_t vlan, Packet* packet) {
+	neighbor_resolve(ni, destination, vlan, packet);
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(neighbor_is_resolved(endian48(ether->dmac))) {
+		neighbor_send(ni, vlan, packet);
+		return true;
+	}
+
+	Map* neighbors = neighbor_map(ni);
+	if(!neighbors) {
+		drop_packet(packet, DROP_NEIGHBOR);
+		return false;
+	}
+
+	uint64_t key = neighbor_key(vlan, destination);
+	Neighbor* neighbor = map_get(neighbors, (void*)key);
+	if(!neighbor) {
+		neighbor = malloc(sizeof(Neighbor));
+		if(!neighbor) {
+			drop_packet(packet, DROP_NEIGHBOR);
+			return false;
+		}
+		bzero(neighbor, sizeof(Neighbor));
+		neighbor->addr = destination;
+		neighbor->vlan = vlan;
+		neighbor->source = source;
+		neighbor->time = neighbor_now();
+
+		if(!map_put(neighbors, (void*)key, neighbor)) {
+			free(neighbor);
+			drop_packet(packet, DROP_NEIGHBOR);
+			return false;
+		}
+
+		if(vlan)
+			neighbor_request(ni, vlan, destination, source);
+	}
+
+	if(neighbor->count >= NEIGHBOR_HOLD) {
+		drop_packet(packet, DROP_NEIGHBOR);
+		return false;
+	}
+
+	neighbor->packets[neighbor->count] = packet;
+	neighbor->vlans[neighbor->count] = vlan;
+	neighbor->count++;
+
+	return true;
+}
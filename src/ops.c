@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/map.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "ops.h"
+#include "service.h"
+#include "server.h"
+#include "schedule.h"
+#include "ratelimit.h"
+#include "vlan.h"
+#include "neighbor.h"
+#include "drop.h"
+#include "shaper.h"
+
+static inline uint32_t ops_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline uint64_t ops_key(uint32_t addr, uint16_t port) {
+	return (uint64_t)IP_PROTOCOL_UDP << 48 | (uint64_t)addr << 16 | (uint64_t)(port & ~(OPS_BLOCK - 1));
+}
+
+static void ops_port_free(Ops* ops, uint32_t count) {
+	for(uint32_t i = 0; i < count; i++)
+		udp_port_free(ops->ni, ops->addr, ops->base + i);
+}
+
+//Reserve an aligned block of ports from the top of port space
+static bool ops_port_alloc(Ops* ops) {
+	for(uint32_t base = 65536 - ops->size; base >= 32768; base -= ops->size) {
+		ops->base = base;
+		uint32_t i;
+		for(i = 0; i < ops->size; i++) {
+			if(!udp_port_alloc0(ops->ni, ops->addr, base + i))
+				break;
+		}
+
+		if(i == ops->size)
+			return true;
+
+		ops_port_free(ops, i);
+	}
+
+	return false;
+}
+
+static void ops_unregister(Map* opses, Ops* ops, uint32_t count) {
+	for(uint32_t i = 0; i < count; i += OPS_BLOCK)
+		map_remove(opses, (void*)ops_key(ops->addr, ops->base + i));
+}
+
+//Reply finds the ring by any block of its ports
+static bool ops_register(Map* opses, Ops* ops) {
+	for(uint32_t i = 0; i < ops->size; i += OPS_BLOCK) {
+		if(!map_put(opses, (void*)ops_key(ops->addr, ops->base + i), ops)) {
+			ops_unregister(opses, ops, i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static Ops* ops_create(Service* service, Endpoint* private_endpoint) {
+	if(!service->ops) {
+		service->ops = map_create(16, NULL, NULL, service->endpoint.ni->pool);
+		if(!service->ops)
+			return NULL;
+	}
+
+	NetworkInterface* ni = private_endpoint->ni;
+	Map* opses = ni_config_get(ni, OPSES);
+	if(!opses) {
+		opses = map_create(16, NULL, NULL, ni->pool);
+		if(!opses)
+			return NULL;
+		if(!ni_config_put(ni, OPSES, opses)) {
+			map_destroy(opses);
+			return NULL;
+		}
+	}
+
+	size_t length = sizeof(Ops) + sizeof(OpsEntry) * service->ops_size;
+	Ops* ops = malloc(length);
+	if(!ops) {
+		printf("Can'nt allocate one-packet ring\n");
+		return NULL;
+	}
+	bzero(ops, length);
+	ops->service = service;
+	ops->ni = ni;
+	ops->addr = private_endpoint->addr;
+	ops->size = service->ops_size;
+
+	if(!ops_port_alloc(ops))
+		goto error;
+
+	if(!ops_register(opses, ops))
+		goto port_free;
+
+	if(!map_put(service->ops, ni, ops)) {
+		ops_unregister(opses, ops, ops->size);
+		goto port_free;
+	}
+
+	return ops;
+
+port_free:
+	ops_port_free(ops, ops->size);
+error:
+	free(ops);
+	return NULL;
+}
+
+static void ops_free(Ops* ops) {
+	Map* opses = ni_config_get(ops->ni, OPSES);
+	if(opses)
+		ops_unregister(opses, ops, ops->size);
+
+	ops_port_free(ops, ops->size);
+	free(ops);
+}
+
+//Schedule each datagram alone. Reply is matched by the NAT port without session.
+bool ops_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
+	Service* service = service_get(service_endpoint);
+	if(!service || !service->one_packet || service->state != SERVICE_STATE_ACTIVE || !service->private_endpoints)
+		return false;
+
+	schedule_set_priority(service);
+	Server* server = service->next(service, client_endpoint);
+	if(!server || server->mode != MODE_NAT)
+		return false;
+
+	NetworkInterface* ni = server->endpoint.ni;
+	Endpoint* private_endpoint = map_get(service->private_endpoints, ni);
+	if(!private_endpoint)
+		return false;
+
+	Ops* ops = service->ops ? map_get(service->ops, ni) : NULL;
+	if(!ops) {
+		ops = ops_create(service, private_endpoint);
+		if(!ops)
+			return false;
+	}
+
+	//Slots are used in turn, so the next is the oldest. Ring is full if it may still get a reply. Datagram takes a session instead.
+	uint32_t now = ops_now();
+	uint32_t index = ops->next & (ops->size - 1);
+	OpsEntry* entry = &ops->entries[index];
+	if(entry->server_addr && now - entry->time <= OPS_TIMEOUT)
+		return false;
+
+	if(service->ratelimit && !ratelimit_admit(service->ratelimit, client_endpoint->addr)) {
+		service->reject_count++;
+		drop_packet(packet, DROP_REJECT);
+		return true;
+	}
+
+	if(!shaper_pass(service->shaper, packet) || !shaper_pass(server->shaper, packet)) {
+		drop_packet(packet, DROP_SHAPED);
+		return true;
+	}
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+
+	ops->next++;
+	entry->client_addr = client_endpoint->addr;
+	entry->client_port = client_endpoint->port;
+	entry->server_addr = server->endpoint.addr;
+	entry->server_port = server->endpoint.port;
+	entry->service_addr = service_endpoint->addr;
+	entry->service_port = service_endpoint->port;
+	entry->payload_id = endian16(udp->length) >= UDP_LEN + 2 ? *(uint16_t*)udp->body : 0;
+	entry->time = now;
+
+	ether->smac = endian48(ni->mac);
+	ether->dmac = endian48(arp_get_mac(ni, server->endpoint.addr, ops->addr));
+	ip->source = endian32(ops->addr);
+	ip->destination = endian32(server->endpoint.addr);
+	udp->source = endian16(ops->base + index);
+	udp->destination = endian16(server->endpoint.port);
+
+	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
+	neighbor_output(ni, server->endpoint.addr, ops->addr, server->endpoint.vlan, packet);
+
+	return true;
+}
+
+bool ops_process_reply(Endpoint* private_endpoint, Endpoint* server_endpoint, Packet* packet) {
+	if(private_endpoint->protocol != IP_PROTOCOL_UDP)
+		return false;
+
+	Map* opses = ni_config_get(private_endpoint->ni, OPSES);
+	if(!opses)
+		return false;
+
+	Ops* ops = map_get(opses, (void*)ops_key(private_endpoint->addr, private_endpoint->port));
+	if(!ops)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+
+	//Late reply of a reused slot has the right server but not the id of the request
+	OpsEntry* entry = &ops->entries[private_endpoint->port - ops->base];
+	if(!entry->server_addr || entry->server_addr != server_endpoint->addr || entry->server_port != server_endpoint->port ||
+			ops_now() - entry->time > OPS_TIMEOUT ||
+			(ops->service->ops_id && (endian16(udp->length) < UDP_LEN + 2 || *(uint16_t*)udp->body != entry->payload_id))) {
+		drop_packet(packet, DROP_INVALID);
+		return true;
+	}
+
+	Service* service = ops->service;
+	if(!shaper_pass(service->shaper, packet)) {
+		drop_packet(packet, DROP_SHAPED);
+		return true;
+	}
+
+	NetworkInterface* ni = service->endpoint.ni;
+	ether->smac = endian48(ni->mac);
+	ether->dmac = endian48(arp_get_mac(ni, entry->client_addr, entry->service_addr));
+	ip->source = endian32(entry->service_addr);
+	ip->destination = endian32(entry->client_addr);
+	udp->source = endian16(entry->service_port);
+	udp->destination = endian16(entry->client_port);
+
+	udp_pack(packet, endian16(ip->length) - ip->ihl * 4 - UDP_LEN);
+	neighbor_output(ni, entry->client_addr, entry->service_addr, service->endpoint.vlan, packet);
+
+	return true;
+}
+
+void ops_remove(Service* service, NetworkInterface* ni) {
+	if(!service->ops)
+		return;
+
+	Ops* ops = map_remove(service->ops, ni);
+	if(ops)
+		ops_free(ops);
+}
+
+void ops_destroy(Service* service) {
+	if(!service->ops)
+		return;
+
+	MapIterator iter;
+	map_iterator_init(&iter, service->ops);
+	while(map_iterator_has_next(&iter)) {
+		MapEntry* entry = map_iterator_next(&iter);
+		ops_free(entry->data);
+	}
+
+	map_destroy(service->ops);
+	service->ops = NULL;
+}
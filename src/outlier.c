@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/event.h>
+#include <util/map.h>
+#include <util/list.h>
+
+#include "outlier.h"
+#include "server.h"
+#include "service.h"
+#include "pool.h"
+#include "health.h"
+
+static inline OutlierBucket* outlier_bucket(Outlier* outlier, uint32_t* _epoch) {
+	uint32_t epoch = (uint32_t)(timer_us() / 1000) / outlier->bucket_time;
+	OutlierBucket* bucket = &outlier->buckets[epoch % OUTLIER_BUCKETS];
+	if(bucket->epoch != epoch) {
+		bucket->epoch = epoch;
+		bucket->success = 0;
+		bucket->error = 0;
+	}
+
+	if(_epoch)
+		*_epoch = epoch;
+
+	return bucket;
+}
+
+//Ejected servers of a service must not exceed max_ejection percent
+static bool outlier_ejectable(Server* server) {
+	bool check(Service* service) {
+		uint32_t total = list_size(service->active_servers) + list_size(service->deactive_servers);
+		uint32_t ejected = 1;
+		ListIterator iter;
+		list_iterator_init(&iter, service->deactive_servers);
+		while(list_iterator_has_next(&iter)) {
+			Server* _server = list_iterator_next(&iter);
+			if(_server->state == SERVER_STATE_EJECTED)
+				ejected++;
+		}
+
+		return ejected * 100 <= total * service->max_ejection;
+	}
+
+	if(server->pool) {
+		if(list_is_empty(server->pool->services))
+			return true;
+
+		return check(list_get_first(server->pool->services));
+	}
+
+	uint32_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		Map* services = ni_config_get(ni_get(i), SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			if(service->pool || !service->active_servers)
+				continue;
+
+			ListIterator _iter;
+			list_iterator_init(&_iter, service->active_servers);
+			while(list_iterator_has_next(&_iter)) {
+				if(list_iterator_next(&_iter) != server)
+					continue;
+
+				if(!check(service))
+					return false;
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool outlier_return_event(void* context) {
+	Outlier* outlier = context;
+	Server* server = outlier->server;
+	outlier->event_id = 0;
+
+	if(server->state != SERVER_STATE_EJECTED)
+		return false;
+
+	bzero(outlier->buckets, sizeof(outlier->buckets));
+	outlier->return_time = timer_us();
+
+	Health* health = server->health;
+	if(health && health->fail_count >= health->fall) {
+		server_set_state(server, SERVER_STATE_DOWN);
+	} else {
+		server_set_state(server, SERVER_STATE_ACTIVE);
+		server_start(server);
+	}
+
+	return false;
+}
+
+static void outlier_eject(Outlier* outlier) {
+	Server* server = outlier->server;
+	if(!outlier_ejectable(server))
+		return;
+
+	//Forget backoff after staying healthy longer than max ejection time
+	uint64_t max_ejection_time = outlier->ejection_time << OUTLIER_MAX_BACKOFF;
+	if(outlier->return_time && timer_us() - outlier->return_time > max_ejection_time)
+		outlier->ejection_count = 0;
+
+	uint64_t ejection_time = outlier->ejection_time << outlier->ejection_count;
+	if(outlier->ejection_count < OUTLIER_MAX_BACKOFF)
+		outlier->ejection_count++;
+
+	outlier->event_id = event_timer_add(outlier_return_event, outlier, ejection_time, 0);
+	if(!outlier->event_id)
+		return;
+
+	uint32_t addr = server->endpoint.addr;
+	printf("Server %d.%d.%d.%d:%d ejected for %ld us\n", (addr >> 24) & 0xff, (addr >> 16) & 0xff,
+			(addr >> 8) & 0xff, addr & 0xff, server->endpoint.port, ejection_time);
+	server_set_state(server, SERVER_STATE_EJECTED);
+}
+
+bool outlier_start(Server* server, uint8_t error_percent, uint32_t min_requests, uint64_t window, uint64_t ejection_time, uint64_t deadline) {
+	if(!error_percent || error_percent > 100 || window < OUTLIER_BUCKETS * 1000 || !ejection_time)
+		return false;
+
+	outlier_stop(server);
+
+	Outlier* outlier = malloc(sizeof(Outlier));
+	if(!outlier) {
+		printf("Can'nt allocate outlier detection\n");
+		return false;
+	}
+	bzero(outlier, sizeof(Outlier));
+
+	outlier->server = server;
+	outlier->error_percent = error_percent;
+	outlier->min_requests = min_requests;
+	outlier->bucket_time = window / 1000 / OUTLIER_BUCKETS;
+	outlier->ejection_time = ejection_time;
+	outlier->deadline = deadline ? deadline : OUTLIER_DEFAULT_DEADLINE;
+
+	server->outlier = outlier;
+
+	return true;
+}
+
+void outlier_stop(Server* server) {
+	Outlier* outlier = server->outlier;
+	if(!outlier)
+		return;
+
+	if(outlier->event_id)
+		event_timer_remove(outlier->event_id);
+
+	free(outlier);
+	server->outlier = NULL;
+}
+
+void outlier_success(Server* server) {
+	Outlier* outlier = server->outlier;
+	if(!outlier)
+		return;
+
+	outlier_bucket(outlier, NULL)->success++;
+}
+
+void outlier_error(Server* server) {
+	Outlier* outlier = server->outlier;
+	if(!outlier)
+		return;
+
+	uint32_t epoch;
+	outlier_bucket(outlier, &epoch)->error++;
+
+	if(server->state != SERVER_STATE_ACTIVE)
+		return;
+
+	uint32_t success = 0;
+	uint32_t error = 0;
+	for(int i = 0; i < OUTLIER_BUCKETS; i++) {
+		OutlierBucket* bucket = &outlier->buckets[i];
+		if(epoch - bucket->epoch >= OUTLIER_BUCKETS)
+			continue;
+
+		success += bucket->success;
+		error += bucket->error;
+	}
+
+	if(success + error < outlier->min_requests)
+		return;
+
+	if(error * 100 >= (success + error) * outlier->error_percent)
+		outlier_eject(outlier);
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+
+#include "persist.h"
+
+static inline uint32_t persist_now() {
+	return (uint32_t)(timer_us() / 1000);
+}
+
+static inline uint32_t persist_hash(Persist* persist, uint32_t addr) {
+	uint32_t hash = addr * 0x9e3779b1;
+
+	return (hash ^ (hash >> 16)) & (persist->size - 1);
+}
+
+static inline bool persist_expired(Persist* persist, PersistEntry* entry, uint32_t now) {
+	return now - entry->time > persist->timeout;
+}
+
+Persist* persist_create(uint64_t timeout, uint8_t prefix, uint32_t size) {
+	if(prefix > 32 || size > PERSIST_MAX_SIZE)
+		return NULL;
+
+	//Round up to power of 2
+	uint32_t _size = PERSIST_PROBE;
+	while(_size < size)
+		_size <<= 1;
+
+	size_t length = sizeof(Persist) + sizeof(PersistEntry) * _size;
+	Persist* persist = malloc(length);
+	if(!persist) {
+		printf("Can'nt allocate persist table\n");
+		return NULL;
+	}
+	bzero(persist, length);
+
+	persist->mask = prefix ? 0xffffffff << (32 - prefix) : 0;
+	persist->timeout = timeout / 1000;
+	persist->size = _size;
+
+	return persist;
+}
+
+void persist_destroy(Persist* persist) {
+	free(persist);
+}
+
+Server* persist_get(Persist* persist, uint32_t addr) {
+	addr &= persist->mask;
+	uint32_t now = persist_now();
+	uint32_t index = persist_hash(persist, addr);
+	for(int i = 0; i < PERSIST_PROBE; i++) {
+		PersistEntry* entry = &persist->entries[(index + i) & (persist->size - 1)];
+		if(!entry->server || entry->addr != addr)
+			continue;
+
+		if(persist_expired(persist, entry, now)) {
+			entry->server = NULL;
+			persist->count--;
+			return NULL;
+		}
+
+		entry->time = now;
+		return entry->server;
+	}
+
+	return NULL;
+}
+
+//Reuses the slot of the same client, an empty or expired slot, otherwise the oldest in probe window
+bool persist_put(Persist* persist, uint32_t addr, Server* server) {
+	addr &= persist->mask;
+	uint32_t now = persist_now();
+	uint32_t index = persist_hash(persist, addr);
+	PersistEntry* victim = NULL;
+	for(int i = 0; i < PERSIST_PROBE; i++) {
+		PersistEntry* entry = &persist->entries[(index + i) & (persist->size - 1)];
+		if(entry->server && entry->addr == addr) {
+			victim = entry;
+			break;
+		}
+
+		if(!entry->server || persist_expired(persist, entry, now)) {
+			if(!victim || victim->server)
+				victim = entry;
+		} else if(!victim || (victim->server && now - entry->time > now - victim->time)) {
+			victim = entry;
+		}
+	}
+
+	if(!victim->server)
+		persist->count++;
+
+	victim->addr = addr;
+	victim->time = now;
+	victim->server = server;
+
+	return true;
+}
+
+void persist_remove_server(Persist* persist, Server* server) {
+	for(uint32_t i = 0; i < persist->size; i++) {
+		PersistEntry* entry = &persist->entries[i];
+		if(entry->server == server) {
+			entry->server = NULL;
+			persist->count--;
+		}
+	}
+}
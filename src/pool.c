@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <util/list.h>
+
+#include "pool.h"
+#include "server.h"
+#include "service.h"
+
+extern void* __gmalloc_pool;
+
+static List* pools;
+
+static bool pool_update(Pool* pool) {
+	uint32_t count = list_size(pool->active_servers);
+	Server** servers = NULL;
+	if(count) {
+		servers = malloc(sizeof(Server*) * count);
+		if(!servers) {
+			printf("Can'nt allocate pool snapshot\n");
+			return false;
+		}
+
+		uint32_t index = 0;
+		ListIterator iter;
+		list_iterator_init(&iter, pool->active_servers);
+		while(list_iterator_has_next(&iter))
+			servers[index++] = list_iterator_next(&iter);
+	}
+
+	Server** old = pool->servers;
+	pool->servers = servers;
+	pool->server_count = count;
+	if(old)
+		free(old);
+
+	return true;
+}
+
+Pool* pool_alloc(char* name) {
+	if(strlen(name) >= POOL_NAME_SIZE)
+		return NULL;
+
+	if(pool_get(name))
+		return NULL;
+
+	if(!pools) {
+		pools = list_create(__gmalloc_pool);
+		if(!pools)
+			return NULL;
+	}
+
+	Pool* pool = malloc(sizeof(Pool));
+	if(!pool) {
+		printf("Can'nt allocate pool\n");
+		return NULL;
+	}
+	bzero(pool, sizeof(Pool));
+	strcpy(pool->name, name);
+
+	pool->active_servers = list_create(__gmalloc_pool);
+	if(!pool->active_servers)
+		goto active_servers_fail;
+
+	pool->deactive_servers = list_create(__gmalloc_pool);
+	if(!pool->deactive_servers)
+		goto deactive_servers_fail;
+
+	pool->services = list_create(__gmalloc_pool);
+	if(!pool->services)
+		goto services_fail;
+
+	if(!list_add(pools, pool))
+		goto pool_add_fail;
+
+	return pool;
+
+pool_add_fail:
+	list_destroy(pool->services);
+services_fail:
+	list_destroy(pool->deactive_servers);
+deactive_servers_fail:
+	list_destroy(pool->active_servers);
+active_servers_fail:
+	free(pool);
+
+	return NULL;
+}
+
+bool pool_free(Pool* pool) {
+	if(!list_is_empty(pool->services) || !list_is_empty(pool->active_servers) || !list_is_empty(pool->deactive_servers)) {
+		printf("Pool is in use\n");
+		return false;
+	}
+
+	list_remove_data(pools, pool);
+	list_destroy(pool->services);
+	list_destroy(pool->deactive_servers);
+	list_destroy(pool->active_servers);
+	if(pool->servers)
+		free(pool->servers);
+	free(pool);
+
+	return true;
+}
+
+Pool* pool_get(char* name) {
+	if(!pools)
+		return NULL;
+
+	ListIterator iter;
+	list_iterator_init(&iter, pools);
+	while(list_iterator_has_next(&iter)) {
+		Pool* pool = list_iterator_next(&iter);
+		if(!strcmp(pool->name, name))
+			return pool;
+	}
+
+	return NULL;
+}
+
+bool pool_add_server(Pool* pool, Server* server) {
+	if(server->state == SERVER_STATE_ACTIVE) {
+		if(!list_add(pool->active_servers, server))
+			return false;
+	} else {
+		if(!list_add(pool->deactive_servers, server))
+			return false;
+	}
+
+	server->pool = pool;
+
+	return pool_update(pool);
+}
+
+bool pool_remove_server(Pool* pool, Server* server) {
+	if(!list_remove_data(pool->active_servers, server) && !list_remove_data(pool->deactive_servers, server))
+		return false;
+
+	server->pool = NULL;
+
+	return pool_update(pool);
+}
+
+bool pool_active_server(Pool* pool, Server* server) {
+	if(!list_remove_data(pool->deactive_servers, server))
+		return false;
+
+	if(!list_add(pool->active_servers, server))
+		return false;
+
+	return pool_update(pool);
+}
+
+bool pool_deactive_server(Pool* pool, Server* server) {
+	if(!list_remove_data(pool->active_servers, server))
+		return false;
+
+	if(!list_add(pool->deactive_servers, server))
+		return false;
+
+	return pool_update(pool);
+}
+
+bool pool_add_service(Pool* pool, Service* service) {
+	if(!list_add(pool->services, service))
+		return false;
+
+	service->pool = pool;
+	service->active_servers = pool->active_servers;
+	service->deactive_servers = pool->deactive_servers;
+
+	return true;
+}
+
+bool pool_remove_service(Pool* pool, Service* service) {
+	if(!list_remove_data(pool->services, service))
+		return false;
+
+	service->pool = NULL;
+	service->active_servers = NULL;
+	service->deactive_servers = NULL;
+
+	return true;
+}
+
+void pool_dump() {
+	printf("Name\t\t\tServices\tActive\tDeactive\n");
+	if(!pools)
+		return;
+
+	ListIterator iter;
+	list_iterator_init(&iter, pools);
+	while(list_iterator_has_next(&iter)) {
+		Pool* pool = list_iterator_next(&iter);
+
+		printf("%s\t\t\t%d\t\t%d\t%d\n", pool->name, list_size(pool->services),
+				list_size(pool->active_servers), list_size(pool->deactive_servers));
+	}
+}
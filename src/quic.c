@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <util/list.h>
+#include <util/map.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "quic.h"
+#include "service.h"
+#include "server.h"
+#include "pool.h"
+
+#define QUIC_LONG_HEADER	0x80
+#define QUIC_TYPE_HANDSHAKE	2
+
+Quic* quic_create() {
+	Quic* quic = malloc(sizeof(Quic));
+	if(!quic)
+		return NULL;
+	bzero(quic, sizeof(Quic));
+	quic->generation = server_get_generation() - 1;
+
+	return quic;
+}
+
+void quic_destroy(Quic* quic) {
+	free(quic);
+}
+
+//Active server, or removing server which still has connections. Down and ejected servers are rescheduled.
+static inline bool quic_is_serving(Server* server) {
+	if(server->state == SERVER_STATE_ACTIVE)
+		return true;
+
+	return server->state == SERVER_STATE_DEACTIVE && server->sessions && map_size(server->sessions);
+}
+
+static void quic_add_servers(Quic* quic, List* servers) {
+	if(!servers)
+		return;
+
+	ListIterator iter;
+	list_iterator_init(&iter, servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* server = list_iterator_next(&iter);
+		if(server->quic_id && quic_is_serving(server))
+			quic->servers[server->quic_id] = server;
+	}
+}
+
+//Removing servers stay in table. Their connections are not broken.
+static void quic_update(Quic* quic, Service* service) {
+	bzero(quic->servers, sizeof(quic->servers));
+	if(service->pool) {
+		quic_add_servers(quic, service->pool->active_servers);
+		quic_add_servers(quic, service->pool->deactive_servers);
+	} else {
+		quic_add_servers(quic, service->active_servers);
+		quic_add_servers(quic, service->deactive_servers);
+	}
+	quic->generation = server_get_generation();
+}
+
+//Destination connection ID of packet. NULL if it is chosen by client.
+static uint8_t* quic_get_cid(Packet* packet, uint8_t* length) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+	uint8_t* payload = udp->body;
+	uint16_t size = endian16(udp->length) - UDP_LEN;
+	if(payload + size > packet->buffer + packet->end)
+		return NULL;
+
+	if(size < 1)
+		return NULL;
+
+	if(!(payload[0] & QUIC_LONG_HEADER)) {
+		if(size < 1 + QUIC_CID_LENGTH)
+			return NULL;
+
+		*length = QUIC_CID_LENGTH;
+		return payload + 1;
+	}
+
+	//Initial and 0-RTT carry connection ID of client
+	if(((payload[0] >> 4) & 0x3) != QUIC_TYPE_HANDSHAKE)
+		return NULL;
+
+	if(size < 6 || size < 6 + payload[5])
+		return NULL;
+
+	*length = payload[5];
+	return payload + 6;
+}
+
+Server* quic_get_server(Service* service, Packet* packet) {
+	Quic* quic = service->quic;
+	uint8_t length = 0;
+	uint8_t* cid = quic_get_cid(packet, &length);
+	if(!cid || length < 2)
+		return NULL;
+
+	if((cid[0] & QUIC_CID_UNROUTABLE) == QUIC_CID_UNROUTABLE)
+		return NULL;
+
+	if(quic->generation != server_get_generation())
+		quic_update(quic, service);
+
+	//Removing server may have lost its last connection since table was built
+	Server* server = quic->servers[cid[1]];
+	if(!server || !quic_is_serving(server))
+		return NULL;
+
+	return server;
+}
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <util/event.h>
+
+#include "ratelimit.h"
+
+static inline uint64_t ratelimit_hash(uint32_t addr) {
+	uint64_t hash = (uint64_t)addr * 0x9e3779b97f4a7c15;
+
+	return hash ^ (hash >> 29);
+}
+
+//Each row takes different 14 bits of the hash
+static inline uint32_t ratelimit_index(uint64_t hash, int row) {
+	return (hash >> (row * 14)) & (RATELIMIT_SKETCH_WIDTH - 1);
+}
+
+static uint16_t sketch_estimate(uint16_t sketch[][RATELIMIT_SKETCH_WIDTH], uint64_t hash) {
+	uint16_t min = UINT16_MAX;
+	for(int i = 0; i < RATELIMIT_SKETCH_DEPTH; i++) {
+		uint16_t count = sketch[i][ratelimit_index(hash, i)];
+		if(count < min)
+			min = count;
+	}
+
+	return min;
+}
+
+static void sketch_increase(uint16_t sketch[][RATELIMIT_SKETCH_WIDTH], uint64_t hash) {
+	for(int i = 0; i < RATELIMIT_SKETCH_DEPTH; i++) {
+		uint16_t* count = &sketch[i][ratelimit_index(hash, i)];
+		if(*count < UINT16_MAX)
+			(*count)++;
+	}
+}
+
+static bool ratelimit_decay(void* context) {
+	RateLimit* ratelimit = context;
+	for(int i = 0; i < RATELIMIT_SKETCH_DEPTH; i++) {
+		for(int j = 0; j < RATELIMIT_SKETCH_WIDTH; j++)
+			ratelimit->news[i][j] >>= 1;
+	}
+
+	return true;
+}
+
+RateLimit* ratelimit_create(uint32_t rate, uint32_t burst, uint32_t max_sessions, uint32_t size) {
+	if(!size)
+		size = RATELIMIT_DEFAULT_SIZE;
+	if(!burst)
+		burst = rate;
+	if(size > RATELIMIT_MAX_SIZE || burst > RATELIMIT_MAX_BURST)
+		return NULL;
+
+	//Round up to power of 2
+	uint32_t _size = RATELIMIT_PROBE;
+	while(_size < size)
+		_size <<= 1;
+
+	size_t length = sizeof(RateLimit) + sizeof(RateBucket) * _size;
+	RateLimit* ratelimit = malloc(length);
+	if(!ratelimit) {
+		printf("Can'nt allocate rate limit\n");
+		return NULL;
+	}
+	bzero(ratelimit, length);
+
+	ratelimit->size = _size;
+	ratelimit->rate = rate;
+	ratelimit->burst = burst;
+	//Client above half of rate is checked. Anyone over rate is limited by its bucket.
+	ratelimit->threshold = rate < burst ? rate : burst;
+	ratelimit->max_sessions = max_sessions;
+
+	if(rate) {
+		ratelimit->event_id = event_timer_add(ratelimit_decay, ratelimit, RATELIMIT_DECAY, RATELIMIT_DECAY);
+		if(!ratelimit->event_id) {
+			free(ratelimit);
+			return NULL;
+		}
+	}
+
+	return ratelimit;
+}
+
+void ratelimit_destroy(RateLimit* ratelimit) {
+	if(ratelimit->event_id)
+		event_timer_remove(ratelimit->event_id);
+
+	free(ratelimit);
+}
+
+static inline uint32_t ratelimit_now() {
+	return (uint32_t)(timer_us() / 1000) | 1;
+}
+
+static RateBucket* ratelimit_find(RateLimit* ratelimit, uint32_t addr, uint64_t hash) {
+	uint32_t index = (uint32_t)(hash >> 32);
+	for(int i = 0; i < RATELIMIT_PROBE; i++) {
+		RateBucket* bucket = &ratelimit->buckets[(index + i) & (ratelimit->size - 1)];
+		if(bucket->time && bucket->addr == addr)
+			return bucket;
+	}
+
+	return NULL;
+}
+
+/*
+ * Find bucket of client or take an empty slot, otherwise the least recently
+ * refilled one without sessions in probe window. NULL if every slot holds sessions.
+ */
+static RateBucket* ratelimit_bucket(RateLimit* ratelimit, uint32_t addr, uint64_t hash, uint32_t now) {
+	uint32_t index = (uint32_t)(hash >> 32);
+	RateBucket* victim = NULL;
+	for(int i = 0; i < RATELIMIT_PROBE; i++) {
+		RateBucket* bucket = &ratelimit->buckets[(index + i) & (ratelimit->size - 1)];
+		if(bucket->time && bucket->addr == addr)
+			return bucket;
+
+		if(bucket->sessions)
+			continue;
+
+		if(!victim || (victim->time && (!bucket->time || now - bucket->time > now - victim->time)))
+			victim = bucket;
+	}
+
+	if(!victim)
+		return NULL;
+
+	victim->addr = addr;
+	victim->time = now;
+	victim->tokens = (uint64_t)ratelimit->burst * 1000;
+	victim->sessions = 0;
+
+	return victim;
+}
+
+bool ratelimit_admit(RateLimit* ratelimit, uint32_t addr) {
+	uint64_t hash = ratelimit_hash(addr);
+
+	if(ratelimit->max_sessions) {
+		RateBucket* bucket = ratelimit_find(ratelimit, addr, hash);
+		if(bucket && bucket->sessions >= ratelimit->max_sessions) {
+			ratelimit->reject_sessions++;
+			return false;
+		}
+	}
+
+	if(!ratelimit->rate)
+		return true;
+
+	//Front filter. Light clients never touch the bucket table.
+	bool heavy = sketch_estimate(ratelimit->news, hash) >= ratelimit->threshold;
+	sketch_increase(ratelimit->news, hash);
+	if(!heavy)
+		return true;
+
+	uint32_t now = ratelimit_now();
+	RateBucket* bucket = ratelimit_bucket(ratelimit, addr, hash, now);
+	if(!bucket)
+		return true;
+
+	uint64_t tokens = bucket->tokens + (uint64_t)(now - bucket->time) * ratelimit->rate;
+	if(tokens > (uint64_t)ratelimit->burst * 1000)
+		tokens = (uint64_t)ratelimit->burst * 1000;
+	bucket->time = now;
+
+	if(tokens < 1000) {
+		bucket->tokens = tokens;
+		ratelimit->reject_rate++;
+		return false;
+	}
+
+	bucket->tokens = tokens - 1000;
+
+	return true;
+}
+
+//false is not counted. Probe window is full of clients holding sessions.
+bool ratelimit_open(RateLimit* ratelimit, uint32_t addr) {
+	if(!ratelimit->max_sessions)
+		return false;
+
+	RateBucket* bucket = ratelimit_bucket(ratelimit, addr, ratelimit_hash(addr), ratelimit_now());
+	if(!bucket)
+		return false;
+
+	bucket->sessions++;
+
+	return true;
+}
+
+void ratelimit_close(RateLimit* ratelimit, uint32_t addr) {
+	RateBucket* bucket = ratelimit_find(ratelimit, addr, ratelimit_hash(addr));
+	if(bucket && bucket->sessions)
+		bucket->sessions--;
+}
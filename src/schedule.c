@@ -2,20 +2,97 @@
 #include "server.h"
 #include "service.h"
 #include "endpoint.h"
+#include "pool.h"
+#include "loadbalancer.h"
+
+//Pool keeps an array snapshot of active servers. Services bound by NIC use the list.
+static inline uint32_t schedule_count(Service* service) {
+	if(service->pool)
+		return service->pool->server_count;
+
+	return list_size(service->active_servers);
+}
+
+static inline Server* schedule_get(Service* service, uint32_t index) {
+	if(service->pool)
+		return service->pool->servers[index];
+
+	return list_get(service->active_servers, index);
+}
+
+//Servers in slow start are admitted in proportion to their ramped weight
+static bool schedule_admit(Server* server) {
+	if(!server->start_time)
+		return true;
+
+	uint32_t weight = (uint32_t)server->weight * SERVER_WEIGHT_SCALE;
+	return (cpu_tsc() % weight) < server_get_weight(server);
+}
+
+//Only servers in the tier being scheduled and under their session cap
+static inline bool schedule_available(Service* service, Server* server) {
+	return server->priority == service->priority && !server_is_full(server);
+}
+
+//Try candidates from index until one is admitted. Falls back to the first available candidate.
+static Server* schedule_admit_from(Service* service, uint32_t index, uint32_t count) {
+	Server* fallback = NULL;
+	for(uint32_t i = 0; i < count; i++) {
+		Server* server = schedule_get(service, (index + i) % count);
+		if(!schedule_available(service, server))
+			continue;
+
+		if(schedule_admit(server))
+			return server;
+
+		if(!fallback)
+			fallback = server;
+	}
+
+	return fallback;
+}
+
+//Select the highest tier that still has capacity. Spill over to backup tiers when full.
+bool schedule_set_priority(Service* service) {
+	if(!service->active_servers)
+		return false;
+
+	bool found = false;
+	uint8_t priority = UINT8_MAX;
+	ListIterator iter;
+	list_iterator_init(&iter, service->active_servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* server = list_iterator_next(&iter);
+		if(server->priority > priority || (found && server->priority == priority))
+			continue;
+
+		if(server_is_full(server))
+			continue;
+
+		priority = server->priority;
+		found = true;
+		if(priority == 0)
+			break;
+	}
+
+	service->priority = priority;
+
+	return found;
+}
 
 Server* schedule_round_robin(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
+	uint32_t count = schedule_count(service);
 	RoundRobin* roundrobin = service->priv;
 	if(count == 0)
 		return NULL; 
 
 	uint32_t index = (roundrobin->robin++) % count;
 
-	return list_get(service->active_servers, index);
+	return schedule_admit_from(service, index, count);
 }
 
 Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
+	uint32_t count = schedule_count(service);
 	RoundRobin* roundrobin = service->priv;
 	if(count == 0)
 		return NULL; 
@@ -25,42 +102,41 @@ Server* schedule_weighted_round_robin(Service* service, Endpoint* client_endpoin
 	list_iterator_init(&iter, service->active_servers);
 	while(list_iterator_has_next(&iter)) {
 		Server* server = list_iterator_next(&iter);
-		whole_weight += server->weight;
+		if(schedule_available(service, server))
+			whole_weight += server_get_weight(server);
 	}
+	if(whole_weight == 0)
+		return schedule_admit_from(service, roundrobin->robin++, count);
 
-	uint32_t _index = (roundrobin->robin++) & whole_weight;
+	uint32_t _index = (uint32_t)(((uint64_t)roundrobin->robin++ * SERVER_WEIGHT_SCALE) % whole_weight);
 	list_iterator_init(&iter, service->active_servers);
 	while(list_iterator_has_next(&iter)) {
 		Server* server = list_iterator_next(&iter);
-		if(_index < server->weight)
+		if(!schedule_available(service, server))
+			continue;
+
+		uint32_t weight = server_get_weight(server);
+		if(_index < weight)
 			return server;
 		else
-			_index -= server->weight;
+			_index -= weight;
 	}
 
 	return NULL;
 }
 
 Server* schedule_random(Service* service, Endpoint* client_endpoint) {
-	inline uint64_t cpu_tsc() {
-		uint64_t time;
-		uint32_t* p = (uint32_t*)&time;
-		asm volatile("rdtsc" : "=a"(p[0]), "=d"(p[1]));
-		
-		return time;
-	}
-
-	uint32_t count = list_size(service->active_servers);
+	uint32_t count = schedule_count(service);
 	if(count == 0)
 		return NULL;
 
 	uint32_t random_num = cpu_tsc() % count;
 
-	return list_get(service->active_servers, random_num);
+	return schedule_admit_from(service, random_num, count);
 }
 
 Server* schedule_least(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
+	uint32_t count = schedule_count(service);
 	if(count == 0)
 		return NULL; 
 
@@ -68,27 +144,75 @@ Server* schedule_least(Service* service, Endpoint* client_endpoint) {
 	ListIterator iter;
 	list_iterator_init(&iter, servers);
 	Server* server = NULL;
-	uint32_t session_count = UINT32_MAX;
+	uint64_t min_cost = UINT64_MAX;
 	while(list_iterator_has_next(&iter)) {
 		Server* _server = list_iterator_next(&iter);
-
-		if(map_size(_server->sessions) < session_count)
+		if(!schedule_available(service, _server))
+			continue;
+
+		//sessions per unit of effective weight
+		uint64_t weight = server_get_weight(_server) + 1;
+		uint64_t sessions = _server->sessions ? map_size(_server->sessions) : 0;
+		uint64_t cost = (sessions + 1) * SERVER_WEIGHT_SCALE * SERVER_WEIGHT_SCALE / weight;
+		if(cost < min_cost) {
+			min_cost = cost;
 			server = _server;
+		}
 	}
 
 	return server;
 }
 
 Server* schedule_source_ip_hash(Service* service, Endpoint* client_endpoint) {
-	uint32_t count = list_size(service->active_servers);
+	uint32_t count = schedule_count(service);
 	if(count == 0)
 		return NULL;
 
 	uint32_t index = client_endpoint->addr % count;
 
-	return list_get(service->active_servers, index);
+	return schedule_admit_from(service, index, count);
 }
 
 Server* schedule_min_request_time(Service* service, Endpoint* client_endpoint) {
-	return NULL;
+	uint32_t count = schedule_count(service);
+	if(count == 0)
+		return NULL;
+
+	//Servers without samples yet are assumed to be average
+	uint64_t latency_sum = 0;
+	uint32_t latency_count = 0;
+	ListIterator iter;
+	list_iterator_init(&iter, service->active_servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* _server = list_iterator_next(&iter);
+		uint64_t latency = _server->rtt + _server->response_time;
+		if(latency) {
+			latency_sum += latency;
+			latency_count++;
+		}
+	}
+	uint64_t latency_default = latency_count ? latency_sum / latency_count : 1;
+
+	Server* server = NULL;
+	uint64_t min_cost = UINT64_MAX;
+	list_iterator_init(&iter, service->active_servers);
+	while(list_iterator_has_next(&iter)) {
+		Server* _server = list_iterator_next(&iter);
+		if(!schedule_available(service, _server))
+			continue;
+
+		uint64_t latency = _server->rtt + _server->response_time;
+		if(!latency)
+			latency = latency_default;
+
+		uint64_t weight = server_get_weight(_server) + 1;
+		uint64_t outstanding = _server->sessions ? map_size(_server->sessions) : 0;
+		uint64_t cost = latency * (outstanding + 1) * SERVER_WEIGHT_SCALE / weight;
+		if(cost < min_cost) {
+			min_cost = cost;
+			server = _server;
+		}
+	}
+
+	return server;
 }
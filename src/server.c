@@ -13,6 +13,7 @@
 #include <net/ip.h>
 #include <net/icmp.h>
 #include <net/checksum.h>
+#include <timer.h>
 
 #include "server.h"
 #include "service.h"
@@ -20,10 +21,28 @@
 #include "nat.h"
 #include "dnat.h"
 #include "dr.h"
+#include "tunnel.h"
+#include "ipv6.h"
+#include "pool.h"
+#include "persist.h"
+#include "health.h"
+#include "outlier.h"
+#include "shaper.h"
 
 extern void* __gmalloc_pool;
 
-static bool server_add(NetworkInterface* ni, Server* server) {
+static uint32_t generation;
+
+//Server lists changed. Consistent hash tables are rebuilt on next lookup
+void server_changed() {
+	generation++;
+}
+
+uint32_t server_get_generation() {
+	return generation;
+}
+
+static bool server_add(NetworkInterface* ni, Server* server, Pool* pool) {
 	Map* servers = ni_config_get(ni, SERVERS);
 	if(!servers) {
 		servers = map_create(16, NULL, NULL, ni->pool);
@@ -33,11 +52,22 @@ static bool server_add(NetworkInterface* ni, Server* server) {
 			return false;
 	}
 
-	uint64_t key = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
+	uint64_t key = endpoint_key(&server->endpoint);
 	if(!map_put(servers, (void*)key, server)) {
 		return false;
 	}
 
+	//Add to pool. Only services using the pool see the server
+	if(pool) {
+		if(!pool_add_server(pool, server)) {
+			map_remove(servers, (void*)key);
+			return false;
+		}
+		server_changed();
+
+		return true;
+	}
+
 	//Add to service active & deactive server list
 	uint32_t count = ni_count();
 	for(int i = 0; i < count; i++) {
@@ -52,6 +82,9 @@ static bool server_add(NetworkInterface* ni, Server* server) {
 			MapEntry* entry = map_iterator_next(&iter);
 			Service* service = entry->data;
 
+			if(service->pool)
+				continue;
+
 			if(!map_contains(service->private_endpoints, ni))
 				continue;
 
@@ -64,11 +97,12 @@ static bool server_add(NetworkInterface* ni, Server* server) {
 			}
 		}
 	}
+	server_changed();
 
 	return true;
 }
 
-Server* server_alloc(Endpoint* server_endpoint) {
+Server* server_alloc(Endpoint* server_endpoint, Pool* pool) {
 	size_t size = sizeof(Server);
 	Server* server = (Server*)malloc(size);
 	if(!server) {
@@ -81,13 +115,15 @@ Server* server_alloc(Endpoint* server_endpoint) {
 
 	server->state = SERVER_STATE_ACTIVE;
 	server->event_id = 0;
+	server->weight = SERVER_DEFAULT_WEIGHT;
 	server_set_mode(server, MODE_NAT);
 
-	if(!server_add(server->endpoint.ni, server))
+	if(!server_add(server->endpoint.ni, server, pool))
 		goto error;
 return server;
 
 error:
+	free(server);
 	return NULL;
 }
 
@@ -116,16 +152,173 @@ bool server_set_mode(Server* server, uint8_t mode) {
 		case MODE_DR:
 			server->create = dr_session_alloc;
 			break;
+		case MODE_TUNNEL:
+			if(!server->tunnel && !server_set_tunnel(server, TUNNEL_IPIP, 0))
+				return false;
+			server->create = tunnel_session_alloc;
+			break;
 		default:
 			return false;
 	}
 
 	server->mode = mode;
+	server_changed();
 
 	return true;
 }
 
+bool server_set_tunnel(Server* server, uint8_t type, uint16_t port) {
+	Tunnel* tunnel = tunnel_create(&server->endpoint, type, port);
+	if(!tunnel)
+		return false;
+
+	//Sessions refer the template
+	if(server->tunnel) {
+		memcpy(server->tunnel, tunnel, sizeof(Tunnel));
+		tunnel_destroy(tunnel);
+	} else
+		server->tunnel = tunnel;
+
+	return true;
+}
+
+//Move server between active & deactive server lists of pool or services
+bool server_set_state(Server* server, uint8_t state) {
+	if(server->state == state)
+		return true;
+
+	server->state = state;
+	server_changed();
+	if(server->pool) {
+		if(state == SERVER_STATE_ACTIVE)
+			return pool_active_server(server->pool, server);
+		else
+			return pool_deactive_server(server->pool, server);
+	}
+
+	uint32_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		NetworkInterface* service_ni = ni_get(i);
+		Map* services = ni_config_get(service_ni, SERVICES);
+		if(!services)
+			continue;
+
+		MapIterator iter;
+		map_iterator_init(&iter, services);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Service* service = entry->data;
+			if(service->pool)
+				continue;
+
+			if(state == SERVER_STATE_ACTIVE) {
+				if(list_remove_data(service->deactive_servers, server))
+					list_add(service->active_servers, server);
+			} else {
+				if(list_remove_data(service->active_servers, server))
+					list_add(service->deactive_servers, server);
+			}
+		}
+	}
+
+	return true;
+}
+
+bool server_set_weight(Server* server, uint8_t weight) {
+	if(!weight)
+		return false;
+
+	server->weight = weight;
+	server_changed();
+
+	return true;
+}
+
+void server_set_priority(Server* server, uint8_t priority) {
+	server->priority = priority;
+	server_changed();
+}
+
+void server_set_max_sessions(Server* server, uint32_t max_sessions) {
+	server->max_sessions = max_sessions;
+}
+
+void server_set_quic_id(Server* server, uint8_t quic_id) {
+	server->quic_id = quic_id;
+	server_changed();
+}
+
+bool server_set_shaper(Server* server, uint64_t pps, uint64_t bps, uint8_t action) {
+	if(server->shaper) {
+		shaper_set(server->shaper, pps, bps, action);
+		return true;
+	}
+
+	server->shaper = shaper_create(pps, bps, action);
+
+	return !!server->shaper;
+}
+
+bool server_is_full(Server* server) {
+	if(!server->max_sessions || !server->sessions)
+		return false;
+
+	return map_size(server->sessions) >= server->max_sessions;
+}
+
+void server_set_slow_start(Server* server, uint64_t slow_start) {
+	server->slow_start = slow_start;
+	server_start(server);
+}
+
+//Called when server joins rotation(added or recovered). Ramp weight from zero.
+void server_start(Server* server) {
+	if(server->slow_start)
+		server->start_time = timer_us();
+	else
+		server->start_time = 0;
+}
+
+uint32_t server_get_weight(Server* server) {
+	uint32_t weight = (uint32_t)server->weight * SERVER_WEIGHT_SCALE;
+	if(!server->start_time)
+		return weight;
+
+	uint64_t elapsed = timer_us() - server->start_time;
+	if(elapsed >= server->slow_start) {
+		server->start_time = 0;
+		return weight;
+	}
+
+	return weight * elapsed / server->slow_start;
+}
+
 bool server_free(Server* server) {
+	health_stop(server);
+	outlier_stop(server);
+	server_changed();
+	if(server->tunnel)
+		tunnel_destroy(server->tunnel);
+	if(server->shaper)
+		shaper_destroy(server->shaper);
+
+	if(server->pool) {
+		//Forget client affinity to this server
+		ListIterator iter;
+		list_iterator_init(&iter, server->pool->services);
+		while(list_iterator_has_next(&iter)) {
+			Service* service = list_iterator_next(&iter);
+			if(service->persist)
+				persist_remove_server(service->persist, server);
+			ipv6_remove_server(service, server);
+		}
+
+		pool_remove_server(server->pool, server);
+		free(server);
+
+		return true;
+	}
+
 	uint32_t count = ni_count();
 	for(int i = 0; i < count; i++) {
 		NetworkInterface* service_ni = ni_get(i);
@@ -140,6 +333,13 @@ bool server_free(Server* server) {
 			MapEntry* entry = map_iterator_next(&iter);
 			Service* service = entry->data;
 
+			if(service->pool)
+				continue;
+
+			if(service->persist)
+				persist_remove_server(service->persist, server);
+			ipv6_remove_server(service, server);
+
 			if(map_contains(service->private_endpoints, server->endpoint.ni)) {
 				if(list_remove_data(service->active_servers, server))
 					continue;
@@ -156,7 +356,7 @@ bool server_free(Server* server) {
 
 Server* server_get(Endpoint* server_endpoint) {
 	Map* servers = ni_config_get(server_endpoint->ni, SERVERS);
-	uint64_t key = (uint64_t)server_endpoint->protocol << 48 | (uint64_t)server_endpoint->addr << 16 | (uint64_t)server_endpoint->port;
+	uint64_t key = endpoint_key(server_endpoint);
 	Server* server = map_get(servers, (void*)key);
 
 	return server;
@@ -164,7 +364,7 @@ Server* server_get(Endpoint* server_endpoint) {
 
 Session* server_get_session(Endpoint* client_endpoint) {
 	Map* sessions = ni_config_get(client_endpoint->ni, SESSIONS);
-	uint64_t key = ((uint64_t)client_endpoint->protocol << 48 | (uint64_t)client_endpoint->addr << 16 | (uint64_t)client_endpoint->port);
+	uint64_t key = endpoint_key(client_endpoint);
 
 	Session* session = map_get(sessions, (void*)key);
 
@@ -184,7 +384,7 @@ void server_is_remove_grace(Server* server) {
 
 		//remove from ni
 		Map* servers = ni_config_get(server->endpoint.ni, SERVERS);
-		uint64_t key = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
+		uint64_t key = endpoint_key(&server->endpoint);
 		map_remove(servers, (void*)key);
 
 		server_free(server);
@@ -215,24 +415,7 @@ bool server_remove(Server* server, uint64_t wait) {
 		server_remove_force(server);
 		return true;
 	} else {
-		server->state = SERVER_STATE_DEACTIVE;
-
-		uint32_t count = ni_count();
-		for(int i = 0; i < count; i++) {
-			NetworkInterface* service_ni = ni_get(i);
-			Map* services = ni_config_get(service_ni, SERVICES);
-			if(!services)
-				continue;
-
-			MapIterator iter;
-			map_iterator_init(&iter, services);
-			while(map_iterator_has_next(&iter)) {
-				MapEntry* entry = map_iterator_next(&iter);
-				Service* service = entry->data;
-				if(list_remove_data(service->active_servers, server))
-					list_add(service->deactive_servers, server);
-			}
-		}
+		server_set_state(server, SERVER_STATE_DEACTIVE);
 
 		if(wait)
 			server->event_id = event_timer_add(server_delete_event, server, wait, 0);
@@ -253,7 +436,7 @@ bool server_remove_force(Server* server) {
 	if(map_is_empty(sessions)) {
 		//delet from ni
 		Map* servers = ni_config_get(server->endpoint.ni, SERVERS);
-		uint64_t key = (uint64_t)server->endpoint.protocol << 48 | (uint64_t)server->endpoint.addr << 16 | (uint64_t)server->endpoint.port;
+		uint64_t key = endpoint_key(&server->endpoint);
 		map_remove(servers, (void*)key);
 
 		server_free(server);
@@ -273,12 +456,38 @@ bool server_remove_force(Server* server) {
 	return true;
 }
 
+//EWMA with gain 1/8 like TCP SRTT. First sample initializes.
+static uint64_t ewma(uint64_t average, uint64_t sample) {
+	if(!average)
+		return sample ? sample : 1;
+
+	return average - (average >> 3) + (sample >> 3);
+}
+
+void server_update_rtt(Server* server, uint64_t sample) {
+	if(!server)
+		return;
+
+	server->rtt = ewma(server->rtt, sample);
+}
+
+void server_update_response_time(Server* server, uint64_t sample) {
+	if(!server)
+		return;
+
+	server->response_time = ewma(server->response_time, sample);
+}
+
 void server_dump() {
 	void print_state(uint8_t state) {
 		if(state == SERVER_STATE_ACTIVE)
 			printf("ACTIVE\t\t");
 		else if(state == SERVER_STATE_DEACTIVE)
 			printf("Removing\t");
+		else if(state == SERVER_STATE_DOWN)
+			printf("Down\t\t");
+		else if(state == SERVER_STATE_EJECTED)
+			printf("Ejected\t\t");
 		else
 			printf("Unnowkn\t");
 	}
@@ -289,6 +498,8 @@ void server_dump() {
 			printf("DNAT\t");
 		else if(mode == MODE_DR)
 			printf("DR\t");
+		else if(mode == MODE_TUNNEL)
+			printf("TUNNEL\t");
 		else
 			printf("Unnowkn\t");
 	}
@@ -310,7 +521,27 @@ void server_dump() {
 			printf("0\t");
 	}
 
-	printf("State\t\tAddr:Port\t\tMode\tNIC\tSessions\n");
+	void print_weight(Server* server) {
+		printf("%d(%d%%)\t", server->weight, server_get_weight(server) * 100 / ((uint32_t)server->weight * SERVER_WEIGHT_SCALE));
+	}
+	void print_limit(Server* server) {
+		printf("%d\t", server->priority);
+		if(server->max_sessions)
+			printf("%d\t", server->max_sessions);
+		else
+			printf("-\t");
+	}
+	void print_latency(Server* server) {
+		printf("%ld\t%ld\t", server->rtt, server->response_time);
+	}
+	void print_shaper(Shaper* shaper) {
+		if(shaper)
+			printf("%ld/%ld\t", shaper_drop_count(shaper), shaper_mark_count(shaper));
+		else
+			printf("-\t");
+	}
+
+	printf("State\t\tAddr:Port\t\tMode\tNIC\tSessions\tWeight\tPrio\tMax\tRTT(us)\tResp(us)\tShaped\tVLAN\n");
 	uint8_t count = ni_count();
 	for(int i = 0; i < count; i++) {
 		Map* servers = ni_config_get(ni_get(i), SERVERS);
@@ -328,7 +559,12 @@ void server_dump() {
 			print_mode(server->mode);
 			print_ni_num(server->endpoint.ni);
 			print_session_count(server->sessions);
-			printf("\n");
+			printf("\t");
+			print_weight(server);
+			print_limit(server);
+			print_latency(server);
+			print_shaper(server->shaper);
+			printf("%d\n", server->endpoint.vlan);
 		}
 	}
 }
@@ -18,9 +18,23 @@
 #include "server.h"
 #include "session.h"
 #include "schedule.h"
+#include "pool.h"
+#include "persist.h"
+#include "outlier.h"
+#include "synproxy.h"
+#include "ratelimit.h"
+#include "maglev.h"
+#include "ops.h"
+#include "quic.h"
+#include "ipv6.h"
+#include "classifier.h"
+#include "shaper.h"
+#include "sync.h"
 
 extern void* __gmalloc_pool;
 
+static Session* service_add_session(Service* service, Server* server, Endpoint* service_endpoint, Endpoint* client_endpoint, uint16_t nat_port);
+
 Service* service_alloc(Endpoint* service_endpoint) {
 	bool service_add(NetworkInterface* ni, Service* service) {
 		Map* services = ni_config_get(ni, SERVICES);
@@ -32,7 +46,7 @@ Service* service_alloc(Endpoint* service_endpoint) {
 				return false;
 		}
 
-		uint64_t key = (uint64_t)service->endpoint.protocol << 48 | (uint64_t)service->endpoint.addr << 16 | (uint64_t)service->endpoint.port;
+		uint64_t key = endpoint_key(&service->endpoint);
 
 		return map_put(services, (void*)key, service);
 	}
@@ -59,9 +73,17 @@ Service* service_alloc(Endpoint* service_endpoint) {
 
 	bzero(service, sizeof(Service));
 	memcpy(&service->endpoint, service_endpoint, sizeof(Endpoint));
+	service->prefix = 32;
+	service->port_end = service_endpoint->port;
 
 	service->timeout = SERVICE_DEFAULT_TIMEOUT;
 	service->state = SERVICE_STATE_ACTIVE;
+	service->max_ejection = SERVICE_DEFAULT_MAX_EJECTION;
+
+	service->priv = __malloc(sizeof(RoundRobin), service_endpoint->ni->pool);
+	if(!service->priv)
+		goto service_priv_alloc_fail;
+	bzero(service->priv, sizeof(RoundRobin));
 
 	service_set_schedule(service, SCHEDULE_ROUND_ROBIN);
 
@@ -72,6 +94,11 @@ Service* service_alloc(Endpoint* service_endpoint) {
 	return service;
 
 service_add_fail:
+	__free(service->priv, service_endpoint->ni->pool);
+
+service_priv_alloc_fail:
+	__free(service, service_endpoint->ni->pool);
+
 service_alloc_fail:
 	//port free
 	if(service_endpoint->protocol == IP_PROTOCOL_TCP) {
@@ -98,13 +125,18 @@ bool service_free(Service* service) {
 			return false;
 		}
 
-		uint64_t key = (uint64_t)service->endpoint.protocol << 48 | (uint64_t)service->endpoint.addr << 16 | (uint64_t)service->endpoint.port;
+		uint64_t key = endpoint_key(&service->endpoint);
 
 		return map_remove(services, (void*)(uintptr_t)key);
 	}
 
 	//remove from service list
 	service_remove(service->endpoint.ni, service);
+	//Published table must not keep pointer of this service
+	if(service_is_range(service) && !classifier_build(service->endpoint.ni)) {
+		printf("Can'nt rebuild classifier. Range services are unreachable until next change\n");
+		classifier_clear(service->endpoint.ni);
+	}
 
 	//remove private endpoirnts
 	if(service->private_endpoints) {
@@ -120,11 +152,28 @@ bool service_free(Service* service) {
 
 		map_destroy(service->private_endpoints);
 	}
+	if(service->persist)
+		persist_destroy(service->persist);
+	if(service->ratelimit)
+		ratelimit_destroy(service->ratelimit);
+	if(service->maglev)
+		maglev_destroy(service->maglev);
+	ops_destroy(service);
+	ipv6_destroy(service);
+	if(service->quic)
+		quic_destroy(service->quic);
+	if(service->shaper)
+		shaper_destroy(service->shaper);
+
 	//server list free
-	if(service->active_servers)
-		list_destroy(service->active_servers);
-	if(service->deactive_servers)
-		list_destroy(service->deactive_servers);
+	if(service->pool) {
+		pool_remove_service(service->pool, service);
+	} else {
+		if(service->active_servers)
+			list_destroy(service->active_servers);
+		if(service->deactive_servers)
+			list_destroy(service->deactive_servers);
+	}
 
 	//port free
 	if(service->endpoint.protocol == IP_PROTOCOL_TCP) {
@@ -140,6 +189,7 @@ bool service_free(Service* service) {
 	}
 
 	//service free
+	__free(service->priv, service->endpoint.ni->pool);
 	__free(service, service->endpoint.ni->pool);
 
 	return true;
@@ -162,6 +212,9 @@ bool service_set_schedule(Service* service, uint8_t schedule) {
 		case SCHEDULE_WEIGHTED_ROUND_ROBIN:
 			service->next = schedule_weighted_round_robin;
 			break;
+		case SCHEDULE_MIN_REQUEST_TIME:
+			service->next = schedule_min_request_time;
+			break;
 		default:
 			return false;
 	}
@@ -170,6 +223,183 @@ bool service_set_schedule(Service* service, uint8_t schedule) {
 	return true;
 }
 
+bool service_set_range(Service* service, uint8_t prefix, uint16_t port_end) {
+	if(prefix > 32 || port_end < service->endpoint.port)
+		return false;
+
+	uint32_t mask = prefix ? (uint32_t)-1 << (32 - prefix) : 0;
+	if(service->endpoint.addr & ~mask)
+		return false;
+
+	uint8_t old_prefix = service->prefix;
+	uint16_t old_port_end = service->port_end;
+	service->prefix = prefix;
+	service->port_end = port_end;
+	if(!classifier_build(service->endpoint.ni)) {
+		service->prefix = old_prefix;
+		service->port_end = old_port_end;
+		return false;
+	}
+
+	return true;
+}
+
+bool service_set_stateless(Service* service, bool stateless) {
+	if(stateless && !service->maglev) {
+		service->maglev = maglev_create();
+		if(!service->maglev)
+			return false;
+	}
+
+	service->stateless = stateless;
+
+	return true;
+}
+
+bool service_set_pickup(Service* service, bool pickup) {
+	if(service->endpoint.protocol != IP_PROTOCOL_TCP)
+		return false;
+
+	if(pickup && !service->maglev) {
+		service->maglev = maglev_create();
+		if(!service->maglev)
+			return false;
+	}
+
+	service->pickup = pickup;
+
+	return true;
+}
+
+//Only DR and tunnel mode servers carry IPv6 traffic. Flows overflowing flow table are placed by consistent hash.
+bool service_set_ipv6(Service* service, uint8_t* addr) {
+	if(!service->maglev) {
+		service->maglev = maglev_create();
+		if(!service->maglev)
+			return false;
+	}
+
+	return ipv6_create(service, addr);
+}
+
+bool service_set_quic(Service* service, bool quic) {
+	if(service->endpoint.protocol != IP_PROTOCOL_UDP)
+		return false;
+
+	if(!quic) {
+		if(service->quic)
+			quic_destroy(service->quic);
+		service->quic = NULL;
+
+		return true;
+	}
+
+	if(!service->quic) {
+		service->quic = quic_create();
+		if(!service->quic)
+			return false;
+	}
+
+	return true;
+}
+
+bool service_set_one_packet(Service* service, bool one_packet, uint32_t size, bool match_id) {
+	if(service->endpoint.protocol != IP_PROTOCOL_UDP)
+		return false;
+
+	if(!size)
+		size = OPS_DEFAULT_SIZE;
+	if(size < OPS_BLOCK || size > OPS_MAX_SIZE || (size & (size - 1)))
+		return false;
+
+	//Ring is rebuilt with new size
+	if(!one_packet || size != service->ops_size)
+		ops_destroy(service);
+
+	service->one_packet = one_packet;
+	service->ops_size = size;
+	service->ops_id = match_id;
+
+	return true;
+}
+
+void service_set_max_sessions(Service* service, uint32_t max_sessions) {
+	service->max_sessions = max_sessions;
+}
+
+bool service_set_ratelimit(Service* service, uint32_t rate, uint32_t burst, uint32_t max_sessions, uint32_t size) {
+	RateLimit* ratelimit = ratelimit_create(rate, burst, max_sessions, size);
+	if(!ratelimit)
+		return false;
+
+	if(service->ratelimit)
+		ratelimit_destroy(service->ratelimit);
+	service->ratelimit = ratelimit;
+
+	return true;
+}
+
+void service_set_syn_proxy(Service* service, bool syn_proxy) {
+	if(service->endpoint.protocol != IP_PROTOCOL_TCP)
+		return;
+
+	service->syn_proxy = syn_proxy;
+}
+
+bool service_set_max_ejection(Service* service, uint8_t max_ejection) {
+	if(max_ejection > 100)
+		return false;
+
+	service->max_ejection = max_ejection;
+
+	return true;
+}
+
+bool service_set_persist(Service* service, uint64_t timeout, uint8_t prefix, uint32_t size) {
+	Persist* persist = persist_create(timeout, prefix, size);
+	if(!persist)
+		return false;
+
+	if(service->persist)
+		persist_destroy(service->persist);
+	service->persist = persist;
+
+	return true;
+}
+
+bool service_set_pool(Service* service, Pool* pool) {
+	if(service->pool == pool)
+		return true;
+
+	if(service->pool) {
+		pool_remove_service(service->pool, service);
+	} else {
+		//Drop server lists bound by NIC
+		if(service->active_servers)
+			list_destroy(service->active_servers);
+		if(service->deactive_servers)
+			list_destroy(service->deactive_servers);
+		service->active_servers = NULL;
+		service->deactive_servers = NULL;
+	}
+
+	server_changed();
+
+	return pool_add_service(pool, service);
+}
+
+//Sessions refer the shaper. Once created, it is only reconfigured.
+bool service_set_shaper(Service* service, uint64_t pps, uint64_t bps, uint8_t action) {
+	if(service->shaper) {
+		shaper_set(service->shaper, pps, bps, action);
+		return true;
+	}
+
+	service->shaper = shaper_create(pps, bps, action);
+
+	return !!service->shaper;
+}
+
 bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 	if(!service->private_endpoints) {
 		service->private_endpoints = map_create(16, NULL, NULL, service->endpoint.ni->pool);
@@ -189,6 +419,17 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 		}
 	}
 
+	//Servers of pool are not bound by NIC
+	if(service->pool) {
+		if(!map_put(service->private_endpoints, private_endpoint->ni, private_endpoint)) {
+			__free(private_endpoint, service->endpoint.ni->pool);
+			return false;
+		}
+		server_changed();
+
+		return true;
+	}
+
 	//create active & deactive server list
 	if(!service->active_servers) {
 		service->active_servers = list_create(service->endpoint.ni->pool);
@@ -213,6 +454,8 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 		while(map_iterator_has_next(&iter)) {
 			MapEntry* entry = map_iterator_next(&iter);
 			Server* server = entry->data;
+			if(server->pool)
+				continue;
 
 			if(server->state == SERVER_STATE_ACTIVE) {
 				if(!list_add(service->active_servers, server))
@@ -227,6 +470,7 @@ bool service_add_private_addr(Service* service, Endpoint* _private_endpoint) {
 	if(!map_put(service->private_endpoints, private_endpoint->ni, private_endpoint)) {
 		goto private_endpoint_put_fail;
 	}
+	server_changed();
 
 	return true;
 
@@ -264,20 +508,28 @@ bool service_remove_private_addr(Service* service, NetworkInterface* ni) {
 	if(!service->private_endpoints)
 		return false;
 
-	//Remove servers belong NetworkInterface
-	List* servers = ni_config_get(ni, SERVERS);
-	ListIterator iter;
-	list_iterator_init(&iter, servers);
-	while(list_iterator_has_next(&iter)) {
-		Server* server = list_iterator_next(&iter);
+	//Remove servers belong NetworkInterface. Servers of pool stay.
+	Map* servers = ni_config_get(ni, SERVERS);
+	if(!service->pool && servers) {
+		MapIterator iter;
+		map_iterator_init(&iter, servers);
+		while(map_iterator_has_next(&iter)) {
+			MapEntry* entry = map_iterator_next(&iter);
+			Server* server = entry->data;
+			if(server->pool)
+				continue;
 
-		if(server->state == SERVER_STATE_ACTIVE) {
-			list_remove_data(service->active_servers, server);
-		} else {
-			list_remove_data(service->deactive_servers, server);
+			if(server->state == SERVER_STATE_ACTIVE) {
+				list_remove_data(service->active_servers, server);
+			} else {
+				list_remove_data(service->deactive_servers, server);
+			}
 		}
 	}
 
+	server_changed();
+	ops_remove(service, ni);
+
 	//Remove Address in NetworkInterface
 	Endpoint* private_endpoint = map_remove(service->private_endpoints, ni);
 	if(!private_endpoint)
@@ -319,13 +571,13 @@ Session* service_get_session(Endpoint* client_endpoint) {
 	if(!sessions)
 		return NULL;
 
-	Session* session = map_get(sessions, (void*)((uint64_t)client_endpoint->protocol << 48 | (uint64_t)client_endpoint->addr << 16 | (uint64_t)client_endpoint->port));
+	Session* session = map_get(sessions, (void*)endpoint_key(client_endpoint));
 
 	return session;
 }
 
 
-Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint) {
+Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
 	Service* service = service_get(service_endpoint);
 	if(!service)
 		return NULL;
@@ -336,23 +588,133 @@ Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endp
 			return NULL;
 	}
 
-	if(!((client_endpoint->addr == service->endpoint.addr) && (client_endpoint->protocol == service->endpoint.protocol) && (client_endpoint->port == service->endpoint.port)))
+	bool range = service_is_range(service);
+	if(!range && !((service_endpoint->addr == service->endpoint.addr) && (service_endpoint->protocol == service->endpoint.protocol) && (service_endpoint->port == service->endpoint.port)))
 		return NULL;
 
 	if(service->state != SERVICE_STATE_ACTIVE)
 		return NULL;
 
-	Server* server = service->next(service, client_endpoint);
+	//Only TCP SYN is known as new flow. Others are connections this instance lost.
+	bool is_new = true;
+	if(packet && service_endpoint->protocol == IP_PROTOCOL_TCP) {
+		Ether* ether = (Ether*)(packet->buffer + packet->start);
+		IP* ip = (IP*)ether->payload;
+		TCP* tcp = (TCP*)ip->body;
+		is_new = tcp->syn && !tcp->ack;
+	}
+
+	//Reject cheaply before scheduling
+	if(service->max_sessions && map_size(service->sessions) >= service->max_sessions)
+		goto reject;
+
+	//Picked up connection was admitted when it started. Without pickup every session is admitted as before.
+	if((is_new || !service->pickup) && service->ratelimit && !ratelimit_admit(service->ratelimit, client_endpoint->addr))
+		goto reject;
+
+	//Same flow maps to the same server, so connection lost by restart or eviction is picked up where it was
+	Server* server = NULL;
+	if(service->pickup) {
+		List* servers = service->pool ? service->pool->active_servers : service->active_servers;
+		server = maglev_get(service->maglev, servers, maglev_hash(client_endpoint, service_endpoint), is_new);
+		if(!server || (is_new && server_is_full(server)))
+			goto reject;
+
+		return service_add_session(service, server, service_endpoint, client_endpoint, 0);
+	}
+
+	//Migrated QUIC connection goes back to the server issued its connection ID
+	if(service->quic && packet) {
+		server = quic_get_server(service, packet);
+		if(server && server_is_full(server))
+			server = NULL;
+	}
+
+	//Known client goes to the same server while it is active
+	if(!server && service->persist) {
+		server = persist_get(service->persist, client_endpoint->addr);
+		if(server && (server->state != SERVER_STATE_ACTIVE || server_is_full(server)))
+			server = NULL;
+	}
+
+	if(!server) {
+		if(!schedule_set_priority(service))
+			goto reject;
+
+		server = service->next(service, client_endpoint);
+		if(!server)
+			goto reject;
+
+		if(service->persist)
+			persist_put(service->persist, client_endpoint->addr, server);
+	}
+
+	return service_add_session(service, server, service_endpoint, client_endpoint, 0);
+
+reject:
+	service->reject_count++;
+
+	return NULL;
+}
+
+//Session of standby is bound to the server and NAT port chosen by its peer
+Session* service_restore_session(Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* server_endpoint, uint16_t nat_port) {
+	Service* service = service_get(service_endpoint);
+	if(!service || service->state != SERVICE_STATE_ACTIVE)
+		return NULL;
+
+	Server* server = server_get(server_endpoint);
 	if(!server)
 		return NULL;
 
+	if(!service->sessions) {
+		service->sessions = map_create(4096, NULL, NULL, service->endpoint.ni->pool);
+		if(!service->sessions)
+			return NULL;
+	}
+
+	return service_add_session(service, server, service_endpoint, client_endpoint, server->mode == MODE_NAT ? nat_port : 0);
+}
+
+static bool service_set_nat_port(Session* session, uint16_t port) {
+	Endpoint* private_endpoint = &session->private_endpoint;
+	if(private_endpoint->protocol == IP_PROTOCOL_TCP) {
+		if(!tcp_port_alloc0(private_endpoint->ni, private_endpoint->addr, port))
+			return false;
+		tcp_port_free(private_endpoint->ni, private_endpoint->addr, private_endpoint->port);
+	} else {
+		if(!udp_port_alloc0(private_endpoint->ni, private_endpoint->addr, port))
+			return false;
+		udp_port_free(private_endpoint->ni, private_endpoint->addr, private_endpoint->port);
+	}
+	private_endpoint->port = port;
+
+	return true;
+}
+
+static Session* service_add_session(Service* service, Server* server, Endpoint* service_endpoint, Endpoint* client_endpoint, uint16_t nat_port) {
 	if(!service->private_endpoints)
 		return NULL;
 
 	Endpoint* private_endpoint = map_get(service->private_endpoints, server->endpoint.ni);
+	if(!private_endpoint)
+		goto error_get_session;
+
 	Session* session = server->create(&(server->endpoint), &(service->endpoint), client_endpoint, private_endpoint);
 	if(!session)
 		goto error_get_session;
+	if(nat_port && session->private_endpoint.port != nat_port && !service_set_nat_port(session, nat_port))
+		goto error_session_map_put1;
+	//Server side key is on VLAN of server
+	session->private_endpoint.vlan = server->endpoint.vlan;
+	session->private_addr = private_endpoint->addr;
+	session->service_shaper = service->shaper;
+	session->server_shaper = server->shaper;
+	//Client is answered from the address and port it reached
+	if(service_is_range(service)) {
+		memcpy(&session->vip, service_endpoint, sizeof(Endpoint));
+		session->public_endpoint = &session->vip;
+	}
 
 	//Add to Service
 	uint64_t public_key = session_get_public_key(session);
@@ -387,6 +749,12 @@ Session* service_alloc_session(Endpoint* service_endpoint, Endpoint* client_endp
 
 
 	session->fin = false;
+	session->limited = service->ratelimit && ratelimit_open(service->ratelimit, client_endpoint->addr);
+	session->latency_state = SESSION_LATENCY_NONE;
+	session->deadline_id = 0;
+	session->proxy_state = SYNPROXY_NONE;
+	session->proxy_packet = NULL;
+	session->sync_time = 0;
 	session->event_id = 0;
 	session_recharge(session);
 
@@ -412,6 +780,8 @@ error_get_server:
 }
 
 bool service_free_session(Session* session) {
+	sync_session(session, SYNC_DELETE);
+
 	//Remove from Service Interface NI
 	Map* sessions = ni_config_get(session->public_endpoint->ni, SESSIONS);
 	uint64_t client_key = session_get_public_key(session);
@@ -428,7 +798,16 @@ bool service_free_session(Session* session) {
 		goto session_free_fail;
 	}
 
+	//Remove from Service
+	Service* service = service_get(session->public_endpoint);
+	if(service && service->sessions)
+		map_remove(service->sessions, (void*)client_key);
+	if(service && service->ratelimit && session->limited)
+		ratelimit_close(service->ratelimit, session->client_endpoint.addr);
+
 	Server* server = server_get(session->server_endpoint);
+	session_deadline_stop(session);
+
 	//Remove from Server
 	if(!map_remove(server->sessions, (void*)private_key)) {
 		printf("Can'nt remove session from servers\n");
@@ -440,6 +819,11 @@ bool service_free_session(Session* session) {
 		session->event_id = 0;
 	}
 
+	if(session->proxy_packet) {
+		ni_free(session->proxy_packet);
+		session->proxy_packet = NULL;
+	}
+
 	session->free(session);
 
 	return true;
@@ -459,9 +843,13 @@ Service* service_get(Endpoint* service_endpoint) {
 	if(!services)
 		return NULL;
 
-	uint64_t key = (uint64_t)service_endpoint->protocol << 48 | (uint64_t)service_endpoint->addr << 16 | (uint64_t)service_endpoint->port;
+	uint64_t key = endpoint_key(service_endpoint);
+
+	Service* service = map_get(services, (void*)key);
+	if(service)
+		return service;
 
-	return map_get(services, (void*)key);
+	return classifier_get(service_endpoint);
 }
 
 void service_is_remove_grace(Service* service) {
@@ -577,6 +965,9 @@ void service_dump() {
 			case SCHEDULE_WEIGHTED_ROUND_ROBIN:
 				printf("Weight Round-Robin\t\t");
 				break;
+			case SCHEDULE_MIN_REQUEST_TIME:
+				printf("Min Request Time\t");
+				break;
 			default:
 				printf("Unnowkn\t");
 				break;
@@ -603,7 +994,39 @@ void service_dump() {
 	}
 
 
-	printf("State\t\tProtocol\tAddr:Port\t\tSchedule\tNIC\tSession\tServer\n");
+	void print_limit(Service* service) {
+		if(service->max_sessions)
+			printf("%d\t", service->max_sessions);
+		else
+			printf("-\t");
+		printf("%ld\t", service->reject_count);
+	}
+	void print_ratelimit(RateLimit* ratelimit) {
+		if(ratelimit)
+			printf("%ld/%ld\t", ratelimit->reject_rate, ratelimit->reject_sessions);
+		else
+			printf("-\t");
+	}
+	void print_range(Service* service) {
+		if(service_is_range(service))
+			printf("/%d:%d-%d\t", service->prefix, service->endpoint.port, service->port_end);
+		else
+			printf("-\t");
+	}
+	void print_shaper(Shaper* shaper) {
+		if(shaper)
+			printf("%ld/%ld\t", shaper_drop_count(shaper), shaper_mark_count(shaper));
+		else
+			printf("-\t");
+	}
+	void print_pool(Pool* pool) {
+		if(pool)
+			printf("%s", pool->name);
+		else
+			printf("-");
+	}
+
+	printf("State\t\tProtocol\tAddr:Port\t\tSchedule\tNIC\tSession\tServer\tMax\tReject\tLimited\tRange\tShaped\tPool\tVLAN\n");
 	int count = ni_count();
 	for(int i = 0; i < count; i++) {
 		NetworkInterface* ni = ni_get(i);
@@ -622,14 +1045,23 @@ void service_dump() {
 			print_state(service->state);
 			print_protocol(service->endpoint.protocol);
 			print_addr_port(service->endpoint.addr, service->endpoint.port);
-			print_schedule(service->schedule);
+			if(service->pickup)
+				printf("Consistent\t");
+			else
+				print_schedule(service->schedule);
 			print_ni_num(service->endpoint.ni);
 			Map* sessions = ni_config_get(service->endpoint.ni, SESSIONS);
 			print_session_count(sessions);
 			print_server_count(service->active_servers);
 			printf(" \040 ");
 			print_server_count(service->deactive_servers);
-			printf("\n");
+			printf("\t");
+			print_limit(service);
+			print_ratelimit(service->ratelimit);
+			print_range(service);
+			print_shaper(service->shaper);
+			print_pool(service->pool);
+			printf("\t%d\n", service->endpoint.vlan);
 		}
 	}
 }
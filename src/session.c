@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <malloc.h>
 #include <gmalloc.h>
+#include <timer.h>
 #include <util/map.h>
 #include <util/event.h>
 #include <net/ether.h>
@@ -11,6 +12,9 @@
 
 #include "session.h"
 #include "service.h"
+#include "server.h"
+#include "outlier.h"
+#include "sync.h"
 
 bool session_recharge(Session* session) {
 	bool session_free_event(void* context) {
@@ -48,6 +52,7 @@ bool session_set_fin(Session* session) {
 		event_timer_remove(session->event_id);
 
 	session->fin = true;
+	sync_session(session, SYNC_UPDATE);
 	session->event_id = event_timer_add(gc, session, 3000, 3000);
 	if(session->event_id == 0) {
 		printf("Can'nt add service\n");
@@ -58,9 +63,109 @@ bool session_set_fin(Session* session) {
 }
 
 inline uint64_t session_get_private_key(Session* session) {
-	return (uint64_t)session->private_endpoint.protocol << 48 | (uint64_t)session->private_endpoint.addr << 16 | (uint64_t)session->private_endpoint.port;
+	return endpoint_key(&session->private_endpoint);
 }
 
 inline uint64_t session_get_public_key(Session* session) {
-	return (uint64_t)session->client_endpoint.protocol << 48 | (uint64_t)session->client_endpoint.addr << 16 | (uint64_t)session->client_endpoint.port;
+	return endpoint_key(&session->client_endpoint);
+}
+
+static uint16_t tcp_payload_length(IP* ip, TCP* tcp) {
+	return endian16(ip->length) - ip->ihl * 4 - tcp->offset * 4;
+}
+
+//Server did not answer in time. Counted now, not when the session expires.
+static bool session_deadline_event(void* context) {
+	Session* session = context;
+	session->deadline_id = 0;
+	if(session->latency_state != SESSION_LATENCY_SYN && session->latency_state != SESSION_LATENCY_REQUEST)
+		return false;
+
+	outlier_error(server_get(session->server_endpoint));
+	session->latency_state = SESSION_LATENCY_DONE;
+
+	return false;
+}
+
+static void session_deadline_start(Session* session) {
+	if(session->deadline_id)
+		return;
+
+	Server* server = server_get(session->server_endpoint);
+	if(!server || !server->outlier)
+		return;
+
+	session->deadline_id = event_timer_add(session_deadline_event, session, server->outlier->deadline, 0);
+}
+
+void session_deadline_stop(Session* session) {
+	if(!session->deadline_id)
+		return;
+
+	event_timer_remove(session->deadline_id);
+	session->deadline_id = 0;
+}
+
+void session_latency_request(Session* session, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+
+	if(ip->protocol == IP_PROTOCOL_UDP) {
+		if(session->latency_state == SESSION_LATENCY_NONE) {
+			session->latency_state = SESSION_LATENCY_REQUEST;
+			session->latency_time = timer_us();
+			session_deadline_start(session);
+		}
+		return;
+	}
+
+	TCP* tcp = (TCP*)ip->body;
+	if(tcp->syn && !tcp->ack) {
+		session->latency_state = SESSION_LATENCY_SYN;
+		session->latency_time = timer_us();
+		session_deadline_start(session);
+	} else if(session->latency_state < SESSION_LATENCY_REQUEST && tcp_payload_length(ip, tcp)) {
+		session->latency_state = SESSION_LATENCY_REQUEST;
+		session->latency_time = timer_us();
+	}
+}
+
+void session_latency_response(Session* session, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+	Server* server;
+
+	switch(session->latency_state) {
+		case SESSION_LATENCY_SYN:
+			if(tcp->rst) {
+				//Server refused handshake
+				session_deadline_stop(session);
+				outlier_error(server_get(session->server_endpoint));
+				session->latency_state = SESSION_LATENCY_DONE;
+				return;
+			}
+
+			if(!(tcp->syn && tcp->ack))
+				return;
+
+			session_deadline_stop(session);
+			server = server_get(session->server_endpoint);
+			server_update_rtt(server, timer_us() - session->latency_time);
+			outlier_success(server);
+			session->latency_state = SESSION_LATENCY_NONE;
+			break;
+		case SESSION_LATENCY_REQUEST:
+			if(ip->protocol == IP_PROTOCOL_TCP && !tcp_payload_length(ip, tcp))
+				return;
+
+			server = server_get(session->server_endpoint);
+			server_update_response_time(server, timer_us() - session->latency_time);
+			if(ip->protocol == IP_PROTOCOL_UDP) {
+				session_deadline_stop(session);
+				outlier_success(server);
+			}
+			session->latency_state = SESSION_LATENCY_DONE;
+			break;
+	}
 }
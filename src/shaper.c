@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <thread.h>
+#include <util/event.h>
+#include <net/ether.h>
+#include <net/ip.h>
+
+#include "shaper.h"
+#include "loadbalancer.h"
+
+static inline uint32_t shaper_threads() {
+	int count = thread_count();
+	if(count < 1)
+		return 1;
+
+	return count < SHAPER_MAX_THREADS ? count : SHAPER_MAX_THREADS;
+}
+
+/*
+ * Rate is split by demand of last period. Every thread keeps a floor share
+ * so that a thread starting to receive the traffic is not starved.
+ */
+static void shaper_rebalance0(Shaper* shaper) {
+	uint32_t threads = shaper_threads();
+	uint64_t total_packets = 0;
+	uint64_t total_bytes = 0;
+	for(uint32_t i = 0; i < threads; i++) {
+		total_packets += shaper->buckets[i].demand_packets;
+		total_bytes += shaper->buckets[i].demand_bytes;
+	}
+
+	uint64_t floor_packets = total_packets / (threads * 4) + 1;
+	uint64_t floor_bytes = total_bytes / (threads * 4) + 1;
+	for(uint32_t i = 0; i < threads; i++) {
+		ShaperBucket* bucket = &shaper->buckets[i];
+		bucket->pps = shaper->pps * (bucket->demand_packets + floor_packets) / (total_packets + floor_packets * threads);
+		bucket->bps = shaper->bps / 8 * (bucket->demand_bytes + floor_bytes) / (total_bytes + floor_bytes * threads);
+		bucket->demand_packets = 0;
+		bucket->demand_bytes = 0;
+	}
+}
+
+static bool shaper_rebalance(void* context) {
+	shaper_rebalance0(context);
+
+	return true;
+}
+
+Shaper* shaper_create(uint64_t pps, uint64_t bps, uint8_t action) {
+	Shaper* shaper = malloc(sizeof(Shaper));
+	if(!shaper) {
+		printf("Can'nt allocate shaper\n");
+		return NULL;
+	}
+	bzero(shaper, sizeof(Shaper));
+
+	shaper->event_id = event_timer_add(shaper_rebalance, shaper, SHAPER_REBALANCE, SHAPER_REBALANCE);
+	if(!shaper->event_id) {
+		free(shaper);
+		return NULL;
+	}
+
+	shaper_set(shaper, pps, bps, action);
+
+	return shaper;
+}
+
+//Sessions keep pointer of shaper. It is changed in place, never replaced.
+void shaper_set(Shaper* shaper, uint64_t pps, uint64_t bps, uint8_t action) {
+	shaper->pps = pps;
+	shaper->bps = bps;
+	shaper->action = action;
+	shaper_rebalance0(shaper);
+}
+
+void shaper_destroy(Shaper* shaper) {
+	if(shaper->event_id)
+		event_timer_remove(shaper->event_id);
+	free(shaper);
+}
+
+static void shaper_mark(Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+		return;
+
+	IP* ip = (IP*)ether->payload;
+	uint16_t old;
+	uint16_t new;
+	memcpy(&old, ip, 2);
+	ip->dscp = SHAPER_DSCP;
+	memcpy(&new, ip, 2);
+
+	uint32_t sum = lb_checksum_adjust((uint16_t)~ip->checksum, old, new);
+	ip->checksum = lb_checksum_fold(sum);
+}
+
+//Take tokens of this thread. Excess is dropped or marked by action.
+bool shaper_process(Shaper* shaper, Packet* packet) {
+	int id = thread_id();
+	if(id >= SHAPER_MAX_THREADS)
+		return true;
+
+	ShaperBucket* bucket = &shaper->buckets[id];
+	uint16_t length = packet->end - packet->start;
+	bucket->demand_packets++;
+	bucket->demand_bytes += length;
+
+	uint64_t now = timer_us();
+	uint64_t elapsed = now - bucket->time;
+	if(elapsed > SHAPER_BURST)
+		elapsed = SHAPER_BURST;
+	bucket->time = now;
+
+	bool excess = false;
+	//Rate times elapsed us is exact in scaled tokens. Nothing is lost however often packets come.
+	if(shaper->pps) {
+		int64_t max = (int64_t)(bucket->pps * SHAPER_BURST) + SHAPER_SCALE;
+		bucket->packets += bucket->pps * elapsed;
+		if(bucket->packets > max)
+			bucket->packets = max;
+
+		if(bucket->packets < SHAPER_SCALE)
+			excess = true;
+	}
+
+	if(shaper->bps) {
+		int64_t cost = (int64_t)length * SHAPER_SCALE;
+		int64_t max = (int64_t)(bucket->bps * SHAPER_BURST) + cost;
+		bucket->bytes += bucket->bps * elapsed;
+		if(bucket->bytes > max)
+			bucket->bytes = max;
+
+		if(bucket->bytes < cost)
+			excess = true;
+	}
+
+	if(!excess) {
+		if(shaper->pps)
+			bucket->packets -= SHAPER_SCALE;
+		if(shaper->bps)
+			bucket->bytes -= (int64_t)length * SHAPER_SCALE;
+
+		return true;
+	}
+
+	if(shaper->action == SHAPER_MARK) {
+		bucket->mark_count++;
+		shaper_mark(packet);
+
+		return true;
+	}
+
+	bucket->drop_count++;
+
+	return false;
+}
+
+uint64_t shaper_drop_count(Shaper* shaper) {
+	uint64_t count = 0;
+	for(int i = 0; i < SHAPER_MAX_THREADS; i++)
+		count += shaper->buckets[i].drop_count;
+
+	return count;
+}
+
+uint64_t shaper_mark_count(Shaper* shaper) {
+	uint64_t count = 0;
+	for(int i = 0; i < SHAPER_MAX_THREADS; i++)
+		count += shaper->buckets[i].mark_count;
+
+	return count;
+}
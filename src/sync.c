@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <timer.h>
+#include <thread.h>
+#include <util/event.h>
+#include <net/ni.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "sync.h"
+#include "service.h"
+#include "server.h"
+#include "session.h"
+#include "synproxy.h"
+#include "shaper.h"
+#include "neighbor.h"
+#include "drop.h"
+
+#define SYNC_RECORDS	((SYNC_MTU - sizeof(SyncHeader)) / sizeof(SyncRecord))
+
+static Sync* current;
+static uint32_t generation;
+static SyncBuffer buffers[SYNC_MAX_THREADS];
+
+static uint8_t sync_ni_index(NetworkInterface* ni) {
+	uint16_t count = ni_count();
+	for(int i = 0; i < count; i++) {
+		if(ni_get(i) == ni)
+			return i;
+	}
+
+	return 0;
+}
+
+static bool sync_buffer_alloc(Sync* sync, SyncBuffer* buffer) {
+	buffer->packet = ni_alloc(sync->ni, ETHER_LEN + IP_LEN + UDP_LEN + SYNC_MTU);
+	if(!buffer->packet)
+		return false;
+
+	buffer->generation = sync->generation;
+	buffer->count = 0;
+	buffer->time = timer_us();
+
+	return true;
+}
+
+static void sync_send(Sync* sync, SyncBuffer* buffer) {
+	Packet* packet = buffer->packet;
+	buffer->packet = NULL;
+
+	NetworkInterface* ni = sync->ni;
+	uint16_t payload_len = sizeof(SyncHeader) + buffer->count * sizeof(SyncRecord);
+	packet->end = packet->start + ETHER_LEN + IP_LEN + UDP_LEN + payload_len;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->dmac = endian48(arp_get_mac(ni, sync->peer, sync->addr));
+	ether->smac = endian48(ni->mac);
+	ether->type = endian16(ETHER_TYPE_IPv4);
+
+	IP* ip = (IP*)ether->payload;
+	ip->ihl = IP_LEN / 4;
+	ip->version = 4;
+	ip->ecn = 0;
+	ip->dscp = 0;
+	ip->length = endian16(IP_LEN + UDP_LEN + payload_len);
+	ip->id = 0;
+	ip->flags_offset = 0;
+	ip->ttl = 64;
+	ip->protocol = IP_PROTOCOL_UDP;
+	ip->source = endian32(sync->addr);
+	ip->destination = endian32(sync->peer);
+
+	UDP* udp = (UDP*)ip->body;
+	udp->source = endian16(SYNC_PORT);
+	udp->destination = endian16(SYNC_PORT);
+	udp->length = endian16(UDP_LEN + payload_len);
+	udp->checksum = 0;
+
+	SyncHeader* header = (SyncHeader*)udp->body;
+	header->magic = endian16(SYNC_MAGIC);
+	header->version = SYNC_VERSION;
+	header->count = buffer->count;
+	header->sequence = endian32(__atomic_fetch_add(&sync->sequence, 1, __ATOMIC_RELAXED) + 1);
+
+	udp_pack(packet, payload_len);
+	sync->last_send = timer_us();
+
+	//Synchronization never takes bandwidth of service traffic over its limit
+	if(!shaper_pass(sync->shaper, packet)) {
+		drop_packet(packet, DROP_SHAPED);
+		return;
+	}
+
+	neighbor_output(ni, sync->peer, sync->addr, 0, packet);
+}
+
+//Buffer of this thread. Message left from a stopped sync is freed by its own thread.
+static SyncBuffer* sync_buffer(Sync* sync) {
+	int id = thread_id();
+	if(id >= SYNC_MAX_THREADS)
+		return NULL;
+
+	SyncBuffer* buffer = &buffers[id];
+	if(buffer->packet && (!sync || buffer->generation != sync->generation)) {
+		ni_free(buffer->packet);
+		buffer->packet = NULL;
+	}
+
+	return buffer;
+}
+
+static void sync_append(Sync* sync, SyncRecord* record) {
+	SyncBuffer* buffer = sync_buffer(sync);
+	if(!buffer)
+		return;
+
+	if(!buffer->packet && !sync_buffer_alloc(sync, buffer))
+		return;
+
+	Ether* ether = (Ether*)(buffer->packet->buffer + buffer->packet->start);
+	IP* ip = (IP*)ether->payload;
+	UDP* udp = (UDP*)ip->body;
+	SyncRecord* records = (SyncRecord*)(udp->body + sizeof(SyncHeader));
+	memcpy(&records[buffer->count++], record, sizeof(SyncRecord));
+	sync->send_count++;
+
+	if(buffer->count >= SYNC_RECORDS)
+		sync_send(sync, buffer);
+}
+
+static void sync_destroy(Sync* sync) {
+	shaper_destroy(sync->shaper);
+	free(sync);
+}
+
+//Replace published sync. Threads in progress keep using old one until grace time passes.
+static void sync_publish(Sync* sync) {
+	bool sync_free_event(void* context) {
+		sync_destroy(context);
+
+		return false;
+	}
+
+	Sync* old = __atomic_exchange_n(&current, sync, __ATOMIC_ACQ_REL);
+	if(!old)
+		return;
+
+	udp_port_free(old->ni, old->addr, SYNC_PORT);
+	if(!event_timer_add(sync_free_event, old, SYNC_GRACE, 0))
+		sync_destroy(old);
+}
+
+bool sync_start(uint8_t role, NetworkInterface* ni, uint32_t addr, uint32_t peer, uint64_t pps, uint64_t bps) {
+	if(role != SYNC_MASTER && role != SYNC_BACKUP)
+		return false;
+
+	sync_stop();
+
+	if(!ni_ip_get(ni, addr)) {
+		if(!ni_ip_add(ni, addr))
+			return false;
+	}
+
+	if(!udp_port_alloc0(ni, addr, SYNC_PORT))
+		return false;
+
+	Sync* sync = malloc(sizeof(Sync));
+	if(!sync)
+		goto sync_alloc_fail;
+	bzero(sync, sizeof(Sync));
+
+	sync->shaper = shaper_create(pps ? pps : SYNC_PPS, bps ? bps : SYNC_BPS, SHAPER_DROP);
+	if(!sync->shaper)
+		goto shaper_create_fail;
+
+	sync->generation = ++generation;
+	sync->role = role;
+	sync->ni = ni;
+	sync->addr = addr;
+	sync->peer = peer;
+	sync_publish(sync);
+
+	return true;
+
+shaper_create_fail:
+	free(sync);
+
+sync_alloc_fail:
+	udp_port_free(ni, addr, SYNC_PORT);
+
+	return false;
+}
+
+void sync_stop() {
+	sync_publish(NULL);
+}
+
+//Master announces session. Only sessions announced on create are updated or deleted.
+void sync_session(Session* session, uint8_t type) {
+	Sync* sync = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if(!sync || sync->role != SYNC_MASTER)
+		return;
+
+	if(type != SYNC_CREATE && !session->sync_time)
+		return;
+
+	//Sequence numbers are not known until server answers
+	if(session->proxy_state == SYNPROXY_CONNECT)
+		return;
+
+	Server* server = server_get(session->server_endpoint);
+	if(!server)
+		return;
+
+	Endpoint* public_endpoint = session->public_endpoint;
+	Endpoint* server_endpoint = session->server_endpoint;
+	SyncRecord record;
+	record.type = type;
+	record.protocol = session->client_endpoint.protocol;
+	record.fin = session->fin;
+	record.proxy_state = session->proxy_state;
+	record.service_ni = sync_ni_index(public_endpoint->ni);
+	record.server_ni = sync_ni_index(server_endpoint->ni);
+	record.service_vlan = endian16(public_endpoint->vlan);
+	record.server_vlan = endian16(server_endpoint->vlan);
+	record.client_addr = endian32(session->client_endpoint.addr);
+	record.client_port = endian16(session->client_endpoint.port);
+	record.service_addr = endian32(public_endpoint->addr);
+	record.service_port = endian16(public_endpoint->port);
+	record.server_addr = endian32(server_endpoint->addr);
+	record.server_port = endian16(server_endpoint->port);
+	record.nat_port = endian16(server->mode == MODE_NAT ? session->private_endpoint.port : 0);
+	record.seq_delta = endian32(session->seq_delta);
+
+	sync_append(sync, &record);
+	session->sync_time = timer_us();
+}
+
+void sync_refresh(Session* session) {
+	if(timer_us() - session->sync_time >= SYNC_REFRESH)
+		sync_session(session, SYNC_UPDATE);
+}
+
+static void sync_apply(Sync* sync, SyncRecord* record) {
+	NetworkInterface* service_ni = ni_get(record->service_ni);
+	NetworkInterface* server_ni = ni_get(record->server_ni);
+	if(!service_ni || !server_ni) {
+		sync->fail_count++;
+		return;
+	}
+
+	Endpoint client_endpoint = {
+		.ni = service_ni,
+		.addr = endian32(record->client_addr),
+		.protocol = record->protocol,
+		.port = endian16(record->client_port),
+		.vlan = endian16(record->service_vlan),
+	};
+
+	Session* session = service_get_session(&client_endpoint);
+	if(record->type == SYNC_DELETE) {
+		if(session)
+			service_free_session(session);
+		else
+			sync->fail_count++;
+
+		return;
+	}
+
+	if(!session) {
+		Endpoint service_endpoint = {
+			.ni = service_ni,
+			.addr = endian32(record->service_addr),
+			.protocol = record->protocol,
+			.port = endian16(record->service_port),
+			.vlan = endian16(record->service_vlan),
+		};
+		Endpoint server_endpoint = {
+			.ni = server_ni,
+			.addr = endian32(record->server_addr),
+			.protocol = record->protocol,
+			.port = endian16(record->server_port),
+			.vlan = endian16(record->server_vlan),
+		};
+
+		session = service_restore_session(&service_endpoint, &client_endpoint, &server_endpoint, endian16(record->nat_port));
+		if(!session) {
+			sync->fail_count++;
+			return;
+		}
+	} else
+		session_recharge(session);
+
+	//Refreshed to new backup if this instance takes over
+	session->sync_time = timer_us();
+	session->proxy_state = record->proxy_state;
+	session->seq_delta = endian32(record->seq_delta);
+	if(record->fin && !session->fin)
+		session_set_fin(session);
+}
+
+//Messages of peer on the dedicated NIC. Backup applies them.
+bool sync_process(Packet* packet) {
+	Sync* sync = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if(!sync || packet->ni != sync->ni)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	if(endian16(ether->type) != ETHER_TYPE_IPv4)
+		return false;
+
+	IP* ip = (IP*)ether->payload;
+	if(ip->protocol != IP_PROTOCOL_UDP || endian32(ip->destination) != sync->addr)
+		return false;
+
+	UDP* udp = (UDP*)ip->body;
+	if(endian16(udp->destination) != SYNC_PORT)
+		return false;
+
+	//Records are read up to UDP length, which must be within the frame
+	SyncHeader* header = (SyncHeader*)udp->body;
+	uint16_t length = endian16(udp->length);
+	if(endian32(ip->source) != sync->peer || (uint8_t*)udp + length > packet->buffer + packet->end ||
+			length < UDP_LEN + sizeof(SyncHeader) ||
+			endian16(header->magic) != SYNC_MAGIC || header->version != SYNC_VERSION ||
+			length < UDP_LEN + sizeof(SyncHeader) + header->count * sizeof(SyncRecord)) {
+		drop_packet(packet, DROP_INVALID);
+		return true;
+	}
+
+	uint32_t sequence = endian32(header->sequence);
+	if(sync->last_receive && sequence - sync->peer_sequence > 1 && sequence - sync->peer_sequence < 0x80000000)
+		sync->lost_count += sequence - sync->peer_sequence - 1;
+	sync->peer_sequence = sequence;
+	sync->last_receive = timer_us();
+	sync->receive_count += header->count;
+
+	if(sync->role == SYNC_BACKUP) {
+		SyncRecord* records = (SyncRecord*)(udp->body + sizeof(SyncHeader));
+		for(int i = 0; i < header->count; i++)
+			sync_apply(sync, &records[i]);
+	}
+
+	ni_free(packet);
+
+	return true;
+}
+
+//Called every loop. Sends partial message of this thread, heartbeat and detects lost master.
+void sync_loop() {
+	Sync* sync = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	SyncBuffer* buffer = sync_buffer(sync);
+	if(!sync || !buffer)
+		return;
+
+	int id = thread_id();
+	uint64_t now = timer_us();
+	if(buffer->packet && now - buffer->time >= SYNC_FLUSH)
+		sync_send(sync, buffer);
+
+	if(id != 0)
+		return;
+
+	if(sync->role == SYNC_MASTER && now - sync->last_send >= SYNC_HEARTBEAT) {
+		if(!buffer->packet && sync_buffer_alloc(sync, buffer))
+			sync_send(sync, buffer);
+	} else if(sync->role == SYNC_BACKUP && sync->last_receive && now - sync->last_receive >= SYNC_DEAD) {
+		printf("Master is lost. Taking over sessions\n");
+		sync->role = SYNC_MASTER;
+	}
+}
+
+void sync_dump() {
+	Sync* sync = current;
+	if(!sync) {
+		printf("Synchronization is off\n");
+		return;
+	}
+
+	void print_addr(uint32_t addr) {
+		printf("%d.%d.%d.%d\t", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+	}
+
+	printf("Role\tNIC\tAddr\t\tPeer\t\tSent\tReceived\tLost\tFailed\tShaped\n");
+	printf("%s\t%d\t", sync->role == SYNC_MASTER ? "MASTER" : "BACKUP", sync_ni_index(sync->ni));
+	print_addr(sync->addr);
+	print_addr(sync->peer);
+	printf("%ld\t%ld\t\t%ld\t%ld\t%ld\n", sync->send_count, sync->receive_count, sync->lost_count, sync->fail_count,
+			shaper_drop_count(sync->shaper));
+}
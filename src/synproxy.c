@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <string.h>
+#include <timer.h>
+#include <net/ether.h>
+#include <net/ip.h>
+#include <net/tcp.h>
+
+#include "synproxy.h"
+#include "vlan.h"
+#include "neighbor.h"
+#include "drop.h"
+#include "tx.h"
+#include "sync.h"
+#include "service.h"
+#include "session.h"
+#include "loadbalancer.h"
+
+#define COOKIE_TIME_SHIFT	26	//Time slot of cookie is about 67 seconds
+#define TCP_OPTION_END		0
+#define TCP_OPTION_NOP		1
+#define TCP_OPTION_MSS		2
+
+static const uint16_t mss_table[] = { 536, 1220, 1440, 1460 };
+static uint64_t secret;
+
+//Before threads start. Every thread signs cookies with the same secret.
+void synproxy_init() {
+	secret = cpu_tsc() * 0x9e3779b97f4a7c15;
+}
+
+static uint32_t cookie_hash(Endpoint* client_endpoint, Endpoint* service_endpoint, uint32_t isn, uint32_t time) {
+	uint64_t hash = secret;
+	hash ^= (uint64_t)client_endpoint->addr << 32 | service_endpoint->addr;
+	hash *= 0x9e3779b97f4a7c15;
+	hash ^= (uint64_t)client_endpoint->port << 48 | (uint64_t)service_endpoint->port << 32 | isn;
+	hash *= 0x9e3779b97f4a7c15;
+	hash ^= time;
+	hash *= 0x9e3779b97f4a7c15;
+
+	return (uint32_t)(hash >> 40);
+}
+
+//Time slot(5 bits) | MSS index(3 bits) | hash(24 bits)
+static uint32_t cookie_make(Endpoint* client_endpoint, Endpoint* service_endpoint, uint32_t isn, uint8_t mss_index) {
+	uint32_t time = (uint32_t)(timer_us() >> COOKIE_TIME_SHIFT);
+
+	return (time & 0x1f) << 27 | (uint32_t)mss_index << 24 | cookie_hash(client_endpoint, service_endpoint, isn, time);
+}
+
+//Returns MSS index or -1 if cookie is invalid. Current and previous slots are valid.
+static int cookie_check(Endpoint* client_endpoint, Endpoint* service_endpoint, uint32_t isn, uint32_t cookie) {
+	uint32_t now = (uint32_t)(timer_us() >> COOKIE_TIME_SHIFT);
+	for(uint32_t time = now - 1; time != now + 1; time++) {
+		if((cookie >> 27) != (time & 0x1f))
+			continue;
+
+		if((cookie & 0xffffff) != cookie_hash(client_endpoint, service_endpoint, isn, time))
+			continue;
+
+		uint8_t mss_index = (cookie >> 24) & 0x7;
+		if(mss_index >= sizeof(mss_table) / sizeof(mss_table[0]))
+			return -1;
+
+		return mss_index;
+	}
+
+	return -1;
+}
+
+static uint8_t mss_index_get(TCP* tcp) {
+	uint16_t mss = mss_table[0];
+	uint8_t* option = tcp->payload;
+	uint8_t* end = (uint8_t*)tcp + tcp->offset * 4;
+	while(option < end) {
+		if(*option == TCP_OPTION_END)
+			break;
+		if(*option == TCP_OPTION_NOP) {
+			option++;
+			continue;
+		}
+		if(option + 1 >= end || option[1] < 2)
+			break;
+		if(*option == TCP_OPTION_MSS && option[1] == 4 && option + 4 <= end) {
+			mss = (uint16_t)option[2] << 8 | option[3];
+			break;
+		}
+		option += option[1];
+	}
+
+	uint8_t index = 0;
+	for(uint8_t i = 0; i < sizeof(mss_table) / sizeof(mss_table[0]); i++) {
+		if(mss_table[i] <= mss)
+			index = i;
+	}
+
+	return index;
+}
+
+static void mss_option_set(TCP* tcp, uint16_t mss) {
+	tcp->payload[0] = TCP_OPTION_MSS;
+	tcp->payload[1] = 4;
+	tcp->payload[2] = mss >> 8;
+	tcp->payload[3] = mss & 0xff;
+	tcp->offset = (TCP_LEN + 4) / 4;
+}
+
+//Answer SYN statelessly. Reuses the packet.
+static void synproxy_syn(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	bool has_option = tcp->offset * 4 >= TCP_LEN + 4;
+	uint8_t mss_index = mss_index_get(tcp);
+	uint32_t isn = endian32(tcp->sequence);
+	uint32_t cookie = cookie_make(client_endpoint, service_endpoint, isn, mss_index);
+
+	ether->dmac = ether->smac;
+	ether->smac = endian48(packet->ni->mac);
+
+	uint32_t addr = ip->source;
+	ip->source = ip->destination;
+	ip->destination = addr;
+	ip->ttl = 64;
+
+	uint16_t port = tcp->source;
+	tcp->source = tcp->destination;
+	tcp->destination = port;
+	tcp->sequence = endian32(cookie);
+	tcp->acknowledgement = endian32(isn + 1);
+	tcp->fin = 0;
+	tcp->syn = 1;
+	tcp->rst = 0;
+	tcp->psh = 0;
+	tcp->ack = 1;
+	tcp->urg = 0;
+	tcp->ece = 0;
+	tcp->cwr = 0;
+	tcp->urgent = 0;
+	tcp->offset = TCP_LEN / 4;
+	if(has_option)
+		mss_option_set(tcp, mss_table[mss_index]);
+
+	uint16_t tcp_len = tcp->offset * 4;
+	ip->length = endian16(ip->ihl * 4 + tcp_len);
+	packet->end = packet->start + ETHER_LEN + ip->ihl * 4 + tcp_len;
+
+	tcp_pack(packet, tcp_len - TCP_LEN);
+	if(!vlan_push(packet, client_endpoint->vlan))
+		drop_packet(packet, DROP_HEADROOM);
+	else
+		tx_output(packet->ni, packet);
+}
+
+/*
+ * SYN toward server rebuilt from held client ACK. Sent again on client retransmit.
+ * MSS index is in the cookie, which is seq_delta until server answers.
+ */
+static bool synproxy_connect(Session* session) {
+	Packet* packet = session->proxy_packet;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	uint16_t length = ETHER_LEN + ip->ihl * 4 + TCP_LEN + 4;
+	Packet* syn = ni_alloc(packet->ni, length);
+	if(!syn)
+		return false;
+
+	memcpy(syn->buffer + syn->start, ether, ETHER_LEN + ip->ihl * 4 + TCP_LEN);
+	syn->end = syn->start + length;
+
+	Ether* syn_ether = (Ether*)(syn->buffer + syn->start);
+	IP* syn_ip = (IP*)syn_ether->payload;
+	TCP* syn_tcp = (TCP*)syn_ip->body;
+	syn_ip->length = endian16(ip->ihl * 4 + TCP_LEN + 4);
+	syn_tcp->sequence = endian32(endian32(tcp->sequence) - 1);
+	syn_tcp->acknowledgement = 0;
+	syn_tcp->fin = 0;
+	syn_tcp->syn = 1;
+	syn_tcp->rst = 0;
+	syn_tcp->psh = 0;
+	syn_tcp->ack = 0;
+	mss_option_set(syn_tcp, mss_table[(session->seq_delta >> 24) & 0x7]);
+
+	NetworkInterface* server_ni = session->server_endpoint->ni;
+	if(!session->translate(session, syn)) {
+		ni_free(syn);
+		return false;
+	}
+	neighbor_output(server_ni, session->server_endpoint->addr, session->private_addr, session->server_endpoint->vlan, syn);
+
+	return true;
+}
+
+//Client completed handshake. Create session and connect to server holding the ACK.
+static bool synproxy_ack(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	Session* session = service_alloc_session(service_endpoint, client_endpoint, packet);
+	if(!session)
+		return false;
+
+	session->proxy_state = SYNPROXY_CONNECT;
+	session->seq_delta = endian32(tcp->acknowledgement) - 1;	//Cookie until server answers
+	session->proxy_packet = packet;
+
+	if(!synproxy_connect(session)) {
+		session->proxy_packet = NULL;
+		service_free_session(session);
+		drop_packet(packet, DROP_HEADROOM);
+	}
+
+	return true;
+}
+
+bool synproxy_process(Endpoint* service_endpoint, Endpoint* client_endpoint, Packet* packet) {
+	if(service_endpoint->protocol != IP_PROTOCOL_TCP)
+		return false;
+
+	Service* service = service_get(service_endpoint);
+	if(!service || !service->syn_proxy)
+		return false;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	if(tcp->syn && !tcp->ack) {
+		synproxy_syn(service_endpoint, client_endpoint, packet);
+		return true;
+	}
+
+	if(tcp->ack && !tcp->syn && !tcp->rst) {
+		int mss_index = cookie_check(client_endpoint, service_endpoint, endian32(tcp->sequence) - 1, endian32(tcp->acknowledgement) - 1);
+		if(mss_index >= 0 && synproxy_ack(service_endpoint, client_endpoint, packet))
+			return true;
+	}
+
+	//Not a valid handshake. Nothing is allocated for it.
+	drop_packet(packet, DROP_INVALID);
+
+	return true;
+}
+
+//Client retransmits while server is connecting. SYN may have been lost, so it is sent again.
+void synproxy_retransmit(Session* session) {
+	synproxy_connect(session);
+}
+
+//Server refused. Held client ACK is turned into RST toward client.
+static void synproxy_reset(Session* session) {
+	Packet* packet = session->proxy_packet;
+	session->proxy_packet = NULL;
+
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	uint64_t mac = ether->dmac;
+	ether->dmac = ether->smac;
+	ether->smac = mac;
+
+	uint32_t addr = ip->source;
+	ip->source = ip->destination;
+	ip->destination = addr;
+	ip->ttl = 64;
+	ip->length = endian16(ip->ihl * 4 + TCP_LEN);
+
+	uint16_t port = tcp->source;
+	tcp->source = tcp->destination;
+	tcp->destination = port;
+	tcp->sequence = tcp->acknowledgement;
+	tcp->acknowledgement = 0;
+	tcp->fin = 0;
+	tcp->syn = 0;
+	tcp->rst = 1;
+	tcp->psh = 0;
+	tcp->ack = 0;
+	tcp->urg = 0;
+	tcp->ece = 0;
+	tcp->cwr = 0;
+	tcp->urgent = 0;
+	tcp->offset = TCP_LEN / 4;
+	packet->end = packet->start + ETHER_LEN + ip->ihl * 4 + TCP_LEN;
+
+	tcp_pack(packet, 0);
+	if(!vlan_push(packet, session->client_endpoint.vlan))
+		drop_packet(packet, DROP_HEADROOM);
+	else
+		tx_output(packet->ni, packet);
+}
+
+//Packet from server while connecting. SYN-ACK releases the held client ACK, RST resets client.
+bool synproxy_connected(Session* session, Packet* packet) {
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	IP* ip = (IP*)ether->payload;
+	TCP* tcp = (TCP*)ip->body;
+
+	if(tcp->rst) {
+		ni_free(packet);
+		synproxy_reset(session);
+		service_free_session(session);
+		return true;
+	}
+
+	if(!(tcp->syn && tcp->ack)) {
+		drop_packet(packet, DROP_INVALID);
+		return true;
+	}
+
+	session_latency_response(session, packet);
+	session->seq_delta = endian32(tcp->sequence) - session->seq_delta;
+	session->proxy_state = SYNPROXY_ESTABLISHED;
+	sync_session(session, SYNC_CREATE);
+	ni_free(packet);
+
+	Packet* pending = session->proxy_packet;
+	session->proxy_packet = NULL;
+
+	NetworkInterface* server_ni = session->server_endpoint->ni;
+	if(!session->translate(session, pending)) {
+		drop_packet(pending, DROP_HEADROOM);
+		return true;
+	}
+	neighbor_output(server_ni, session->server_endpoint->addr, session->private_addr, session->server_endpoint->vlan, pending);
+
+	return true;
+}
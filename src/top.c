@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <thread.h>
+#include <util/event.h>
+#include <net/ip.h>
+
+#include "top.h"
+
+static Top tops[TOP_MAX_THREADS];
+
+static inline uint32_t top_set(uint64_t key) {
+	uint64_t hash = key * 0x9e3779b97f4a7c15;
+
+	return (uint32_t)(hash >> 40) & (TOP_SIZE - 1) & ~(TOP_WAYS - 1);
+}
+
+static inline void top_count(TopEntry* entries, uint64_t key, uint64_t weight) {
+	TopEntry* set = &entries[top_set(key)];
+	TopEntry* min = &set[0];
+	for(int i = 0; i < TOP_WAYS; i++) {
+		if(set[i].key == key && set[i].count) {
+			set[i].count += weight;
+			return;
+		}
+
+		if(set[i].count < min->count)
+			min = &set[i];
+	}
+
+	//Replace the least counter of the set and inherit its count as error
+	min->key = key;
+	min->error = min->count;
+	min->count += weight;
+}
+
+static bool top_decay(void* context) {
+	Top* top = context;
+	for(int i = 0; i < TOP_KEYS; i++) {
+		for(int j = 0; j < TOP_METRICS; j++) {
+			for(int k = 0; k < TOP_SIZE; k++) {
+				top->entries[i][j][k].count >>= 1;
+				top->entries[i][j][k].error >>= 1;
+			}
+		}
+	}
+
+	return true;
+}
+
+//Called by every thread. Each thread decays its own counters.
+bool top_init() {
+	int id = thread_id();
+	if(id >= TOP_MAX_THREADS)
+		return false;
+
+	return !!event_timer_add(top_decay, &tops[id], TOP_DECAY, TOP_DECAY);
+}
+
+void top_update(Endpoint* source_endpoint, Endpoint* service_endpoint, uint16_t length) {
+	int id = thread_id();
+	if(id >= TOP_MAX_THREADS)
+		return;
+
+	Top* top = &tops[id];
+	uint64_t service_key = (uint64_t)service_endpoint->protocol << 48 | (uint64_t)service_endpoint->addr << 16 | (uint64_t)service_endpoint->port;
+
+	top_count(top->entries[TOP_SOURCE][TOP_PACKETS], source_endpoint->addr, 1);
+	top_count(top->entries[TOP_SOURCE][TOP_BYTES], source_endpoint->addr, length);
+	top_count(top->entries[TOP_SERVICE][TOP_PACKETS], service_key, 1);
+	top_count(top->entries[TOP_SERVICE][TOP_BYTES], service_key, length);
+}
+
+void top_reset() {
+	bzero(tops, sizeof(tops));
+}
+
+//Merge counters of all threads and print the largest
+void top_dump(uint8_t key, uint8_t metric, uint32_t count) {
+	void print_key(uint64_t _key) {
+		uint32_t addr = key == TOP_SOURCE ? (uint32_t)_key : (uint32_t)(_key >> 16);
+		printf("%d.%d.%d.%d", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+		if(key == TOP_SERVICE)
+			printf(":%d %s", (uint16_t)_key, (uint8_t)(_key >> 48) == IP_PROTOCOL_TCP ? "TCP" : "UDP");
+	}
+
+	uint32_t size = TOP_MAX_THREADS * TOP_SIZE;
+	TopEntry* merged = malloc(sizeof(TopEntry) * size);
+	if(!merged) {
+		printf("Can'nt allocate top\n");
+		return;
+	}
+
+	uint32_t merged_count = 0;
+	for(int i = 0; i < TOP_MAX_THREADS; i++) {
+		TopEntry* entries = tops[i].entries[key][metric];
+		for(int j = 0; j < TOP_SIZE; j++) {
+			if(!entries[j].count)
+				continue;
+
+			int k;
+			for(k = 0; k < merged_count; k++) {
+				if(merged[k].key == entries[j].key)
+					break;
+			}
+
+			if(k == merged_count) {
+				merged[k] = entries[j];
+				merged_count++;
+			} else {
+				merged[k].count += entries[j].count;
+				merged[k].error += entries[j].error;
+			}
+		}
+	}
+
+	printf("Rank\t%s\t\t\t%s\tError\n", key == TOP_SOURCE ? "Source" : "Service", metric == TOP_PACKETS ? "Packets" : "Bytes");
+	for(uint32_t rank = 1; rank <= count && merged_count; rank++) {
+		uint32_t max = 0;
+		for(uint32_t i = 1; i < merged_count; i++) {
+			if(merged[i].count > merged[max].count)
+				max = i;
+		}
+
+		printf("%d\t", rank);
+		print_key(merged[max].key);
+		printf("\t\t%ld\t%ld\n", merged[max].count, merged[max].error);
+
+		merged[max] = merged[--merged_count];
+	}
+
+	free(merged);
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#define DONT_MAKE_WRAPPER
+#include <_malloc.h>
+#undef DONT_MAKE_WRAPPER
+#include <net/packet.h>
+#include <net/ether.h>
+#include <net/arp.h>
+#include <net/ip.h>
+#include <net/udp.h>
+
+#include "tunnel.h"
+#include "endpoint.h"
+#include "session.h"
+#include "server.h"
+#include "ipv6.h"
+
+static bool tunnel_translate(Session* session, Packet* packet);
+static bool tunnel_untranslate(Session* session, Packet* packet);
+static bool tunnel_free(Session* session);
+
+Tunnel* tunnel_create(Endpoint* server_endpoint, uint8_t type, uint16_t port) {
+	Tunnel* tunnel = malloc(sizeof(Tunnel));
+	if(!tunnel) {
+		printf("Can'nt allocate tunnel\n");
+		return NULL;
+	}
+	bzero(tunnel, sizeof(Tunnel));
+
+	tunnel->type = type;
+	tunnel->ni = server_endpoint->ni;
+	tunnel->addr = server_endpoint->addr;
+
+	IP* ip = (IP*)tunnel->header;
+	ip->version = 4;
+	ip->ihl = IP_LEN / 4;
+	ip->ttl = 64;
+	ip->destination = endian32(server_endpoint->addr);
+	switch(type) {
+		case TUNNEL_IPIP:
+			ip->protocol = IP_PROTOCOL_IP;
+			tunnel->length = IP_LEN;
+			break;
+		case TUNNEL_GUE:
+			ip->protocol = IP_PROTOCOL_UDP;
+			tunnel->length = IP_LEN + UDP_LEN;
+			UDP* udp = (UDP*)ip->body;
+			udp->destination = endian16(port);
+			break;
+		default:
+			free(tunnel);
+			return NULL;
+	}
+
+	//Length, source and checksum are zero in template
+	uint16_t* words = (uint16_t*)tunnel->header;
+	for(int i = 0; i < IP_LEN / 2; i++)
+		tunnel->sum += endian16(words[i]);
+
+	return tunnel;
+}
+
+void tunnel_destroy(Tunnel* tunnel) {
+	free(tunnel);
+}
+
+//Replace ether header of client packet with outer headers. Inner IP packet is not touched.
+bool tunnel_encap(Tunnel* tunnel, uint32_t source, Packet* packet) {
+	uint16_t push = tunnel->length;
+	if(packet->start < push) {
+		if(packet->end + push > packet->size)
+			return false;
+
+		memmove(packet->buffer + packet->start + push, packet->buffer + packet->start, packet->end - packet->start);
+		packet->start += push;
+		packet->end += push;
+	}
+
+	IP* inner = (IP*)((Ether*)(packet->buffer + packet->start))->payload;
+	uint16_t inner_length;
+	uint32_t hash;
+	uint8_t protocol = tunnel->type == TUNNEL_IPIP ? IP_PROTOCOL_IP : IP_PROTOCOL_UDP;
+	if(inner->version == 6) {
+		IPv6* inner6 = (IPv6*)inner;
+		uint32_t words[8];
+		memcpy(words, inner6->source, 32);
+		inner_length = IPV6_LEN + endian16(inner6->length);
+		hash = (words[3] ^ words[7]) * 0x9e3779b1;
+		if(inner6->next_header == IP_PROTOCOL_TCP || inner6->next_header == IP_PROTOCOL_UDP)
+			hash ^= *(uint32_t*)inner6->body * 0x85ebca6b;
+		if(tunnel->type == TUNNEL_IPIP)
+			protocol = IP_PROTOCOL_IPV6;
+	} else {
+		inner_length = endian16(inner->length);
+		hash = (endian32(inner->source) ^ endian32(inner->destination)) * 0x9e3779b1;
+		if(inner->protocol == IP_PROTOCOL_TCP || inner->protocol == IP_PROTOCOL_UDP)
+			hash ^= *(uint32_t*)inner->body * 0x85ebca6b;
+	}
+
+	packet->start -= push;
+	Ether* ether = (Ether*)(packet->buffer + packet->start);
+	ether->type = endian16(ETHER_TYPE_IPv4);
+	ether->smac = endian48(tunnel->ni->mac);
+	ether->dmac = endian48(arp_get_mac(tunnel->ni, tunnel->addr, source));
+
+	IP* ip = (IP*)ether->payload;
+	memcpy(ip, tunnel->header, push);
+
+	//IPv6 in IPIP differs from template only by protocol
+	uint16_t length = push + inner_length;
+	uint32_t sum = tunnel->sum + length + (source >> 16) + (source & 0xffff);
+	if(protocol != ip->protocol) {
+		sum += protocol - ip->protocol;
+		ip->protocol = protocol;
+	}
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	ip->length = endian16(length);
+	ip->source = endian32(source);
+	ip->checksum = endian16(~sum);
+
+	//Source port carries flow entropy for ECMP and RSS of server. Checksum is optional.
+	if(tunnel->type == TUNNEL_GUE) {
+		UDP* udp = (UDP*)ip->body;
+		udp->source = endian16(49152 | ((hash ^ (hash >> 16)) & 0x3fff));
+		udp->length = endian16(UDP_LEN + inner_length);
+	}
+
+	return true;
+}
+
+Session* tunnel_session_alloc(Endpoint* server_endpoint, Endpoint* service_endpoint, Endpoint* client_endpoint, Endpoint* private_endpoint) {
+	Server* server = server_get(server_endpoint);
+	if(!server || !server->tunnel)
+		return NULL;
+
+	Session* session = __malloc(sizeof(Session), server_endpoint->ni->pool);
+	if(!session) {
+		printf("Can'nt allocate Session\n");
+		return NULL;
+	}
+
+	session->server_endpoint = server_endpoint;
+	session->public_endpoint = service_endpoint;
+
+	//Server replies to client directly. Private endpoint is only a key.
+	memcpy(&session->client_endpoint, client_endpoint, sizeof(Endpoint));
+	memcpy(&session->private_endpoint, client_endpoint, sizeof(Endpoint));
+	session->tunnel = server->tunnel;
+	session->tunnel_source = private_endpoint->addr;
+
+	session->event_id = 0;
+	session_recharge(session);
+	session->fin = false;
+
+	session->translate = tunnel_translate;
+	session->untranslate = tunnel_untranslate;
+	session->free = tunnel_free;
+
+	return session;
+}
+
+static bool tunnel_free(Session* session) {
+	__free(session, session->server_endpoint->ni->pool);
+
+	return true;
+}
+
+//false is no headroom for outer header. Caller drops the packet.
+static bool tunnel_translate(Session* session, Packet* packet) {
+	if(!tunnel_encap(session->tunnel, session->tunnel_source, packet))
+		return false;
+	session_recharge(session);
+
+	return true;
+}
+
+static bool tunnel_untranslate(Session* session, Packet* packet) {
+	//do nothing
+	return true;
+}
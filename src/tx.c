@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <thread.h>
+#include <net/ni.h>
+
+#include "tx.h"
+#include "drop.h"
+
+static TxQueue queues[TX_MAX_THREADS];
+
+static bool tx_try(NetworkInterface* ni, Packet* packet) {
+	for(int i = 0; i < TX_RETRY; i++) {
+		if(ni_output(ni, packet))
+			return true;
+	}
+
+	return false;
+}
+
+//Send deferred packets until an output ring is still full
+void tx_flush() {
+	int id = thread_id();
+	if(id >= TX_MAX_THREADS)
+		return;
+
+	TxQueue* queue = &queues[id];
+	while(queue->head != queue->tail) {
+		TxEntry* entry = &queue->entries[queue->head & (TX_QUEUE - 1)];
+		if(!ni_output(entry->ni, entry->packet))
+			return;
+
+		queue->head++;
+	}
+}
+
+/*
+ * Packet is always consumed. Full ring is retried a few times, then the
+ * packet waits in deferred queue. Packets behind deferred ones are queued
+ * to keep order. Queue overflow is dropped, so NIC pool never leaks.
+ */
+bool tx_output(NetworkInterface* ni, Packet* packet) {
+	int id = thread_id();
+	if(id >= TX_MAX_THREADS) {
+		if(tx_try(ni, packet))
+			return true;
+
+		drop_packet(packet, DROP_TX_FULL);
+		return false;
+	}
+
+	TxQueue* queue = &queues[id];
+	if(queue->head != queue->tail)
+		tx_flush();
+
+	if(queue->head == queue->tail && tx_try(ni, packet))
+		return true;
+
+	if(queue->tail - queue->head >= TX_QUEUE) {
+		drop_packet(packet, DROP_TX_FULL);
+		return false;
+	}
+
+	TxEntry* entry = &queue->entries[queue->tail++ & (TX_QUEUE - 1)];
+	entry->ni = ni;
+	entry->packet = packet;
+
+	return true;
+}